@@ -38,6 +38,7 @@ struct Decl : Symbol {
     ir::Value *value;
 
     bool is_global = false;
+    bool is_memo = false;  // a table made by memo, unseen by the program
 
     Decl(bool is_const, const string &name, bool has_init = false);
 
@@ -41,6 +41,18 @@ Value *Use::release() {
 
 bool ir::no_value_check;
 
+static Arena arena;
+
+void *Pooled::operator new(std::size_t n) {
+    return arena.alloc(n);
+}
+
+void Pooled::operator delete(void *p, std::size_t n) {
+    arena.free(p, n);
+}
+
+Value::Value(ValueKind kind) : kind(kind) {}
+
 Value::~Value() {
     if (!ir::no_value_check)
         asserts(uses.empty());
@@ -79,7 +91,7 @@ Inst *BB::get_control() const {
     return i;
 }
 
-vector<BB *> BB::get_succ() const {
+SmallVec<BB *, 2> BB::get_succ() const {
     auto *i = get_control();
     if_a (BranchInst, x, i)
         return {x->bb_then, x->bb_else};
@@ -92,7 +104,7 @@ vector<BB *> BB::get_succ() const {
     unreachable();
 }
 
-vector<BB **> BB::get_succ_mut() const {
+SmallVec<BB **, 2> BB::get_succ_mut() const {
     auto *i = get_control();
     if_a (BranchInst, x, i)
         return {&x->bb_then, &x->bb_else};
@@ -105,6 +117,10 @@ vector<BB **> BB::get_succ_mut() const {
     unreachable();
 }
 
+bool BB::doms(const BB *v) const {
+    return dom_in <= v->dom_in && v->dom_out <= dom_out;
+}
+
 Prog::Prog(vector<Decl *> &&globals) : globals(globals) {}
 
 Func::Func(bool returns_int, const char *name) :
@@ -124,6 +140,14 @@ BB *Func::new_bb() {
     return bb;
 }
 
+BB *Func::new_bb_after(BB *o) {
+    auto *bb = new BB;
+    bb->id = bb_cnt++;
+    bb->func = this;
+    bbs.insert_after(o, bb);
+    return bb;
+}
+
 void Func::push_bb(BB *bb) {
     // debug("%s: pushing bb_to %d", name.data(), bb_cnt);
     bb->id = bb_cnt++;
@@ -135,30 +159,50 @@ GetIntFunc::GetIntFunc() : Func(true, "getint") {}
 PrintfFunc::PrintfFunc(const char *fmt, std::size_t len) :
     Func(false, "printf"), fmt(fmt), len(len) {}
 
+PrintfFunc::PrintfFunc(string &&fmt) :
+    Func(false, "printf"), own(std::move(fmt)) {
+    this->fmt = own.data();
+    len = own.size();
+}
+
 
-Const::Const(int val) : val(val) {}
+Const::Const(int val) : Value(vk::Const), val(val) {}
 
 Const Const::ZERO{0}, Const::ONE{1};
 
+static std::unordered_map<int, Const *> memo = {
+    { 0, &Const::ZERO },
+    { 1, &Const::ONE }
+};
+
 Const *Const::of(int val) {
-    static std::unordered_map<int, Const *> memo = {
-        { 0, &Const::ZERO },
-        { 1, &Const::ONE }
-    };
     auto it = memo.find(val);
     if (it != memo.end())
         return it->second;
     return memo[val] = new Const{val};
 }
 
-Global::Global(const Decl *var) : var(var) {}
+void ir::release_ir() {
+    arena.release();
+    memo = {
+        { 0, &Const::ZERO },
+        { 1, &Const::ONE }
+    };
+    // uses of the static values lived in the arena as well
+    for (Value *v: {(Value *) &Const::ZERO, (Value *) &Const::ONE, (Value *) &Undef::VAL})
+        v->uses = List<Use>{};
+}
 
-Argument::Argument(Decl *var, uint pos) : var(var), pos(pos) {}
+Global::Global(const Decl *var) : Value(vk::Global), var(var) {}
+
+Argument::Argument(Decl *var, uint pos) : Value(vk::Argument), var(var), pos(pos) {}
+
+Undef::Undef() : Value(vk::Undef) {}
 
 Undef Undef::VAL;
 
 BinaryInst::BinaryInst(OpKind op, Value *lhs, Value *rhs) :
-        op(op), lhs(lhs, this), rhs(rhs, this) {}
+        Inst(vk::Binary), op(op), lhs(lhs, this), rhs(rhs, this) {}
 
 bool BinaryInst::is_op_mirror(OpKind a, OpKind b) {
     using namespace tkd;
@@ -177,40 +221,41 @@ bool BinaryInst::is_op_mirror(OpKind a, OpKind b) {
     }
 }
 
-MemInst::MemInst(Decl *lhs, Value *base, Value *off) :
-    lhs(lhs), base(base, this), off(off, this) {}
+MemInst::MemInst(ValueKind kind, Decl *lhs, Value *base, Value *off) :
+    Inst(kind), lhs(lhs), base(base, this), off(off, this) {}
 
 LoadInst::LoadInst(Decl *lhs, Value *base, Value *off) :
-    MemInst(lhs, base, off) {}
+    MemInst(vk::Load, lhs, base, off) {}
 
 StoreInst::StoreInst(Decl *lhs, Value *base, Value *off, Value *val) :
-    MemInst(lhs, base, off), val(val, this) {}
+    MemInst(vk::Store, lhs, base, off), val(val, this) {}
 
 GEPInst::GEPInst(Decl *lhs, Value *base, Value *off, int size) :
-    MemInst(lhs, base, off), size(size) {}
+    MemInst(vk::GEP, lhs, base, off), size(size) {}
 
 BranchInst::BranchInst(Value *cond, BB *bb_then, BB *bb_else) :
-    cond(cond, this), bb_then(bb_then), bb_else(bb_else) {}
+    Inst(vk::Branch), cond(cond, this), bb_then(bb_then), bb_else(bb_else) {}
 
-JumpInst::JumpInst(BB *bb) : bb_to(bb) {}
+JumpInst::JumpInst(BB *bb) : Inst(vk::Jump), bb_to(bb) {}
 
-ReturnInst::ReturnInst(Value *val) : val(val, this) {}
+ReturnInst::ReturnInst(Value *val) : Inst(vk::Return), val(val, this) {}
 
-CallInst::CallInst(Func *func) : func(func) {}
+CallInst::CallInst(Func *func) : Inst(vk::Call), func(func) {}
 
-CallInst::CallInst(Func *func, const vector<Value *> &argv) : func(func) {
+CallInst::CallInst(Func *func, const vector<Value *> &argv) : Inst(vk::Call), func(func) {
     args.reserve(argv.size());
     for (auto *arg : argv)
         args.emplace_back(arg, this);
 }
 
-AllocaInst::AllocaInst(Decl *var) : var(var) {}
+AllocaInst::AllocaInst(Decl *var) : Inst(vk::Alloca), var(var) {}
 
-PhiInst::PhiInst() {
+PhiInst::PhiInst() : Inst(vk::Phi) {
     vals.reserve(2);
 }
 
-BinaryBranchInst::BinaryBranchInst(Op op, BinaryInst *old_bin, BranchInst *old_br) : op(op),
+BinaryBranchInst::BinaryBranchInst(Op op, BinaryInst *old_bin, BranchInst *old_br) :
+    Inst(vk::BinaryBranch), op(op),
     lhs(old_bin->lhs.value, this), rhs(old_bin->rhs.value, this),
     bb_then(old_br->bb_then), bb_else(old_br->bb_else) {}
 
@@ -231,6 +276,8 @@ void PhiInst::push(Value *val, BB *bb) {
     vals.emplace_back(Use{val, this}, bb);
 }
 
+Inst::Inst(ValueKind kind) : Value(kind) {}
+
 // impure Call, Control, Store
 bool Inst::has_side_effects() const {
     if_a (const CallInst, x, this)
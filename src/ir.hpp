@@ -4,6 +4,7 @@
 #include "ast.hpp"
 
 #include <set>
+#include <deque>
 
 // TODO: introduce size multiplier 4 and li insts before syscall into IR?
 
@@ -80,7 +81,30 @@ struct Use : Node<Use> {
 
 extern bool no_value_check;
 
-struct Value {
+// Tags for classof, where kinds of Inst and MemInst are kept contiguous
+namespace vk {
+
+enum ValueKind {
+    Const, Global, Argument, Undef,
+    Binary, Call, Branch, Jump, Return,
+    Load, Store, GEP,
+    Alloca, Phi, BinaryBranch
+};
+
+}
+
+using vk::ValueKind;
+
+// Nodes of IR are allocated from one arena, which is freed by release_ir
+struct Pooled {
+    static void *operator new(std::size_t n);
+    static void operator delete(void *p, std::size_t n);
+};
+
+void release_ir();  // all Progs built must be dropped then
+
+struct Value : Pooled {
+    const ValueKind kind;
     List<Use> uses;
 
     mips::Operand mach_res = mips::Operand::make_void();
@@ -93,10 +117,11 @@ struct Value {
 
     virtual void print_val(std::ostream &) = 0;
 
+    explicit Value(ValueKind kind);
     virtual ~Value();
 };
 
-struct Loop {
+struct Loop : Pooled {
     vector<Loop *> chs;
     vector<BB *> bbs;
     Loop *parent = nullptr;
@@ -107,11 +132,11 @@ struct Loop {
     ~Loop();
 };
 
-struct BB : Node<BB> {
+struct BB : Node<BB>, Pooled {
     List<Inst> insts;
 
     bool vis;
-    std::set<BB *> dom, dom_chs;
+    vector<BB *> dom_chs;
     BB *idom;
     vector<BB *> pred, df;
 
@@ -121,6 +146,7 @@ struct BB : Node<BB> {
     int id;
 
     int dom_depth;
+    uint po, dom_in, dom_out;  // by build_dom
     Loop *loop = nullptr;
 
     bool is_once = false;
@@ -142,12 +168,14 @@ struct BB : Node<BB> {
     void erase(Inst *i);
     void erase_with(Inst *i, Value *v);
     Inst *get_control() const;
-    vector<BB *> get_succ() const;
+    SmallVec<BB *, 2> get_succ() const;
     // this gives wrong results when multiple control insts are ill-formed,
     // i.e. there are insts after the first control inst in one
     // or after br_induce where BinaryBranchInsts occur
 
-    vector<BB **> get_succ_mut() const;
+    SmallVec<BB **, 2> get_succ_mut() const;
+
+    bool doms(const BB *v) const;  // reflexive, requires build_dom
 
     friend std::ostream &operator << (std::ostream &, const BB &);
 };
@@ -169,14 +197,22 @@ struct Func {
     bool is_once;
     bool is_unused = false;
 
+    // Memory a call may write or read, by cg: non-const globals, and what
+    // array params point to by pos
+    std::set<const Decl *> mod_globals, ref_globals;
+    vector<bool> mod_params, ref_params;
+
     vector<Loop *> loop_roots;
 
+    uint valid = 0;  // cached analyses, see ana::Kind
+
     Func(bool returns_int, const char *name);
     Func(bool returns_int, vector<Decl *> &&params, string &&name);
 
     virtual ~Func() = default;
 
     BB *new_bb();
+    BB *new_bb_after(BB *o);
 
     void push_bb(BB *bb);
 };
@@ -191,14 +227,16 @@ struct GetIntFunc : Func {
 struct PrintfFunc : Func {
     const char *fmt;
     size_t len;
+    string own;  // for fmts made by passes
 
     PrintfFunc(const char *fmt, size_t len);
+    explicit PrintfFunc(string &&fmt);
 };
 
 struct Prog {
     vector<Decl *> globals;
     vector<Func> funcs;
-    vector<PrintfFunc> printfs;
+    std::deque<PrintfFunc> printfs;  // which passes may add to
     GetIntFunc getint;
 
     explicit Prog(vector<Decl *> &&globals);
@@ -207,6 +245,8 @@ struct Prog {
 };
 
 struct Const : Value {
+    static bool classof(const Value *v) { return v->kind == vk::Const; }
+
     static constexpr const int MAX = mips::Operand::MAX_CONST;
     static constexpr const int MIN = mips::Operand::MIN_CONST;
 
@@ -224,6 +264,8 @@ struct Const : Value {
 };
 
 struct Global : Value {
+    static bool classof(const Value *v) { return v->kind == vk::Global; }
+
     const Decl *var;
 
     explicit Global(const Decl *var);
@@ -234,6 +276,8 @@ struct Global : Value {
 };
 
 struct Argument : Value {
+    static bool classof(const Value *v) { return v->kind == vk::Argument; }
+
     Decl *var;
     uint pos;
 
@@ -245,21 +289,27 @@ struct Argument : Value {
 };
 
 struct Undef : Value {
+    static bool classof(const Value *v) { return v->kind == vk::Undef; }
+
     static Undef VAL;
 
+    Undef();
+
     mips::Operand build_val(mips::Builder *) override;
 
     void print_val(std::ostream &) override;
 };
 
 struct Inst : Value, Node<Inst> {
+    static bool classof(const Value *v) { return v->kind >= vk::Binary; }
+
     BB *bb; // must be set by BB after new Inst!
 
     uint id;
 
     bool vis;
 
-    Inst() = default;
+    explicit Inst(ValueKind kind);
 
     bool has_side_effects() const;
     bool is_control() const;
@@ -275,8 +325,11 @@ struct Inst : Value, Node<Inst> {
 };
 
 struct BinaryInst : Inst {
+    static bool classof(const Value *v) { return v->kind == vk::Binary; }
+
     OpKind op;  // no And / Or
     Use lhs, rhs;
+    bool is_lhs_nonneg = false;  // by vrp, for div and mod
 
     BinaryInst(OpKind op, Value *lhs, Value *rhs);
 
@@ -288,6 +341,8 @@ struct BinaryInst : Inst {
 };
 
 struct CallInst : Inst {
+    static bool classof(const Value *v) { return v->kind == vk::Call; }
+
     Func *func;
     vector<Use> args;
 
@@ -301,6 +356,8 @@ struct CallInst : Inst {
 };
 
 struct BranchInst : Inst {
+    static bool classof(const Value *v) { return v->kind == vk::Branch; }
+
     Use cond;
     BB *bb_then, *bb_else;
 
@@ -312,6 +369,8 @@ struct BranchInst : Inst {
 };
 
 struct JumpInst : Inst {
+    static bool classof(const Value *v) { return v->kind == vk::Jump; }
+
     BB *bb_to;
 
     explicit JumpInst(BB *bb);
@@ -322,6 +381,8 @@ struct JumpInst : Inst {
 };
 
 struct ReturnInst : Inst {
+    static bool classof(const Value *v) { return v->kind == vk::Return; }
+
     Use val; // nullable
 
     explicit ReturnInst(Value *val);
@@ -346,13 +407,17 @@ struct PrintfInst : Inst {
  */
 
 struct MemInst : Inst {
+    static bool classof(const Value *v) { return v->kind >= vk::Load && v->kind <= vk::GEP; }
+
     Decl *lhs;
     Use base, off;
 
-    MemInst(Decl *lhs, Value *base, Value *off);
+    MemInst(ValueKind kind, Decl *lhs, Value *base, Value *off);
 };
 
 struct LoadInst : MemInst {
+    static bool classof(const Value *v) { return v->kind == vk::Load; }
+
     LoadInst(Decl *lhs, Value *base, Value *idx);
 
     mips::Operand build(mips::Builder *) override;
@@ -361,6 +426,8 @@ struct LoadInst : MemInst {
 };
 
 struct StoreInst : MemInst {
+    static bool classof(const Value *v) { return v->kind == vk::Store; }
+
     Use val;
 
     StoreInst(Decl *lhs, Value *base, Value *idx, Value *val);
@@ -371,6 +438,8 @@ struct StoreInst : MemInst {
 };
 
 struct GEPInst : MemInst {
+    static bool classof(const Value *v) { return v->kind == vk::GEP; }
+
     int size;
 
     GEPInst(Decl *lhs, Value *base, Value *idx, int size);
@@ -381,6 +450,8 @@ struct GEPInst : MemInst {
 };
 
 struct AllocaInst : Inst {
+    static bool classof(const Value *v) { return v->kind == vk::Alloca; }
+
     Decl *var;
 
     int aid;  // mem2reg
@@ -393,6 +464,8 @@ struct AllocaInst : Inst {
 };
 
 struct PhiInst : Inst {
+    static bool classof(const Value *v) { return v->kind == vk::Phi; }
+
     vector<std::pair<Use, BB *>> vals;  // TBD
 
     int aid = -1; // mem2reg
@@ -423,6 +496,8 @@ int eval(RelOp, int, int);
 using rel::RelOp;
 
 struct BinaryBranchInst : Inst {
+    static bool classof(const Value *v) { return v->kind == vk::BinaryBranch; }
+
     using Op = RelOp;
     Op op;
     Use lhs, rhs;
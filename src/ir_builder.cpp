@@ -335,7 +335,6 @@ Prog build_ir(ast::Prog &&ast) {
     for (auto *fun: ast.funcs)
         fun->ir = &res.funcs[i++];
 
-    res.printfs.reserve(ast.printfs.size());
     for (auto *pr: ast.printfs)
         res.printfs.emplace_back(pr->fmt, pr->len);
 
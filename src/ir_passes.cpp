@@ -1,11 +1,26 @@
 #include "ir_common.hpp"
+#include "passes.hpp"
 
 bool dcbe(Func *);
 bool dge(Prog *);
 void dle(Func *);
-void mem2reg(Func *);
+bool sccp(Func *);
+bool tre(Func *);
+void promote(Func *);
+void sroa(Func *);
+void unroll(Func *);
+void scev(Func *);
+void sr(Func *);
+void vrp(Func *);
 void br_induce(Func *);
 void gg(Func *f);
+void inl(Prog *p);
+void memo(Prog *);
+bool fold_calls(Prog *);
+bool pe(Prog *);
+
+bool use_memoize = false;
+bool use_pe = false;
 
 template <class T>
 static Prog &operator << (Prog &lh, T (*rh)(Func *)) {
@@ -35,12 +50,18 @@ void all(Prog *prog) {
     *prog << cd << gg << dle;
 }
 
+// Loops are used by mips::Builder
+static void loops(Func *f) {
+    require(f, ana::Loops);
+}
+
 void run_passes(Prog &prog, bool opt) {
     if (!opt) {
         prog << cd;  // dcbe is required
         return;
     }
-    prog << cd << dge << mem2reg << all << all << cd
-         << br_induce
-         << build_loop;
+    prog << cd << inl << cd << dge << mem2reg << tre << sccp << sroa << all << fold_calls << sccp << memo << pe << cd
+         << sccp << promote << scev << all << unroll << sccp << sroa << fold_calls << sccp << all << cd
+         << sr << cd << vrp << cd << br_induce
+         << loops;
 }
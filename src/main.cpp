@@ -8,6 +8,7 @@
 #include <iostream>
 #include <fstream>
 #include <cstdlib>
+#include <cstring>
 
 #ifdef SYC_DUMP
     #include <cerrno>
@@ -54,6 +55,21 @@ string read_stdin() {
     return s;
 }
 
+// Options are dropped from argv, leaving the positional args
+int parse_opts(int argc, char **argv) {
+    int n = 1;
+    for (int i = 1; i < argc; ++i)
+        if (!std::strcmp(argv[i], "--linear-scan"))
+            use_linear_scan = true;
+        else if (!std::strcmp(argv[i], "--memoize"))
+            use_memoize = true;
+        else if (!std::strcmp(argv[i], "--pe"))
+            use_pe = true;
+        else
+            argv[n++] = argv[i];
+    return n;
+}
+
 std::pair<string, const char *> parse_args(int argc, char **argv) {
     if (argc > 1) {
         if (argc >= 4)  // syc src.c -o out.asm
@@ -81,6 +97,7 @@ static void put_file(T &x, const char *file) {
 void work(int argc, char **argv) {
     std::ofstream outf;
     std::ostream *out = &outf;
+    argc = parse_opts(argc, argv);
 
 #ifdef SYC_STDIN
     auto p = parse_args(argc, argv);
@@ -143,6 +160,7 @@ void work(int argc, char **argv) {
     run_mips_passes(mr);
     debug_put(mr, "mr2.asm");
     extra_put(ir, asm_file);
+    ir::release_ir();
 
     *out << mr;
 
@@ -153,6 +171,7 @@ void work(int argc, char **argv) {
     extra_put(naive_ir, naive_ir_file);
 
     mips::Prog naive_mr = build_mr(naive_ir);
+    ir::release_ir();
     run_mips_passes(naive_mr);
     extra_put(naive_mr, naive_asm_file);
 #endif
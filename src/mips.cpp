@@ -81,6 +81,95 @@ Operand Func::make_vreg() {
     return Operand::make_virtual(vreg_cnt++);
 }
 
+uint RegSet::index(const Reg &r) {
+    asserts(r.is_uncolored());
+    if (r.is_machine())
+        return Regs::inv_allocatable[r.val];
+    return 32 + uint(r.val);
+}
+
+Reg RegSet::reg(uint i) {
+    if (i < 32)
+        return Reg::make_machine(Regs::allocatable[i]);
+    return Reg::make_virtual(i - 32);
+}
+
+Reg RegSet::iterator::operator * () const {
+    return reg(i);
+}
+
+RegSet::iterator &RegSet::iterator::operator ++ () {
+    i = s->find(i + 1);
+    return *this;
+}
+
+uint RegSet::find(uint from) const {
+    uint n = bits.size();
+    for (uint w = from >> 6; w < n; ++w) {
+        uint64_t x = bits[w];
+        if (w == from >> 6)
+            x &= ~uint64_t(0) << (from & 63);
+        if (x)
+            return (w << 6) | uint(__builtin_ctzll(x));
+    }
+    return capacity();
+}
+
+void RegSet::insert(const Reg &r) {
+    uint i = index(r);
+    if ((i >> 6) >= bits.size())
+        bits.resize((i >> 6) + 1);
+    bits[i >> 6] |= uint64_t(1) << (i & 63);
+}
+
+void RegSet::erase(const Reg &r) {
+    uint i = index(r);
+    if ((i >> 6) < bits.size())
+        bits[i >> 6] &= ~(uint64_t(1) << (i & 63));
+}
+
+bool RegSet::count(const Reg &r) const {
+    uint i = index(r);
+    return (i >> 6) < bits.size() && (bits[i >> 6] >> (i & 63) & 1);
+}
+
+void RegSet::clear() {
+    bits.clear();
+}
+
+bool RegSet::empty() const {
+    return std::all_of(bits.begin(), bits.end(), [](uint64_t x) { return !x; });
+}
+
+bool RegSet::assign_flow(const RegSet &use, const RegSet &out, const RegSet &def) {
+    uint n = std::max(use.bits.size(), out.bits.size());
+    if (bits.size() < n)
+        bits.resize(n);
+    bool changed = false;
+    for (uint w = 0; w < n; ++w) {
+        uint64_t x = w < use.bits.size() ? use.bits[w] : 0;
+        if (w < out.bits.size())
+            x |= out.bits[w] & ~(w < def.bits.size() ? def.bits[w] : 0);
+        if (x != bits[w]) {
+            bits[w] = x;
+            changed = true;
+        }
+    }
+    for (uint w = n; w < bits.size(); ++w)
+        if (bits[w]) {
+            bits[w] = 0;
+            changed = true;
+        }
+    return changed;
+}
+
+void RegSet::unite(const RegSet &rhs) {
+    if (bits.size() < rhs.bits.size())
+        bits.resize(rhs.bits.size());
+    for (uint w = 0; w < rhs.bits.size(); ++w)
+        bits[w] |= rhs.bits[w];
+}
+
 Prog::Prog(ir::Prog *ir) : ir(ir) {}
 
 uint Prog::find_str(const string &s) {
@@ -2,6 +2,8 @@
 
 #include "ir.hpp"
 #include <unordered_map>
+#include <array>
+#include <cstdint>
 
 const uint MAX_ARG_REGS = 4;
 
@@ -26,10 +28,44 @@ typedef Operand Reg;
 
 constexpr uint DATA_BASE = 0x10010000u;
 
+// Dense bitset of uncolored regs, where allocatable machine regs take the
+// first 32 bits by Regs::inv_allocatable, followed by virtual regs by id
+struct RegSet {
+    vector<uint64_t> bits;
+
+    struct iterator {
+        const RegSet *s;
+        uint i;
+
+        Reg operator * () const;
+        iterator &operator ++ ();
+        bool operator != (const iterator &o) const { return i != o.i; }
+    };
+
+    static uint index(const Reg &r);
+    static Reg reg(uint i);
+
+    uint capacity() const { return uint(bits.size()) << 6; }
+    uint find(uint from) const;  // the first member not less than from, or capacity()
+
+    void insert(const Reg &r);
+    void erase(const Reg &r);
+    bool count(const Reg &r) const;
+    void clear();
+    bool empty() const;
+
+    // *this = use | (out & ~def), returning whether it is changed
+    bool assign_flow(const RegSet &use, const RegSet &out, const RegSet &def);
+    void unite(const RegSet &rhs);
+
+    iterator begin() const { return {this, find(0)}; }
+    iterator end() const { return {this, capacity()}; }
+};
+
 struct BB : Node<BB> {
     List<Inst> insts;
     vector<BB *> succ;
-    std::set<Reg> use, def, live_in, live_out;
+    RegSet use, def, live_in, live_out;
 
     uint id;
 
@@ -143,7 +179,7 @@ struct Inst : Node<Inst> {
 
 struct BinaryInst : Inst {  // add, sub, slt ?
     enum Op {
-        Add, Sub, Lt, Ltu, Xor, Mul
+        Add, Sub, Lt, Ltu, Xor, And, Mul
     } op;
     Reg dst, lhs;
     Operand rhs;  // value range is ignored
@@ -169,8 +205,6 @@ struct MoveInst : Inst {  // move or li
     Reg dst;
     Operand src;
 
-    bool active = false;  // active_moves
-
     MoveInst(Reg dst, Operand src);
 
     void print(std::ostream &) const override;
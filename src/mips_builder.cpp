@@ -169,7 +169,8 @@ static Reg build_reg_mult_const(Reg lh, int rh, Builder *ctx) {
     return dst;
 }
 
-static Operand build_reg_div_const(Reg lh, int d, bool is_mod, Builder *ctx) {
+// nonneg if lh is known to be non-negative
+static Operand build_reg_div_const(Reg lh, int d, bool is_mod, bool nonneg, Builder *ctx) {
     uint a = d;
     if (d < 0)
         a = -a;
@@ -184,22 +185,27 @@ static Operand build_reg_div_const(Reg lh, int d, bool is_mod, Builder *ctx) {
 
     Reg dst;
     if (!(a & (a - 1))) {
-        /* this fails negative lhs and fixing's not worth it:
-            dst = ctx->make_vreg();
-            ctx->new_binary(BinaryInst::And, dst, lh, Operand::make_const(a - 1));
-            if (d < 0)
-                return build_neg_reg(dst, ctx);
-            return dst;
-        */
         uint l = __builtin_ctz(a);
-        auto v0 = ctx->make_vreg();
-        ctx->push(new ShiftInst{ShiftInst::Ra, v0, lh, l - 1});
-        auto v1 = ctx->make_vreg();
-        ctx->push(new ShiftInst{ShiftInst::Rl, v1, v0, 32 - l});
-        auto v2 = ctx->make_vreg();
-        ctx->push(new BinaryInst{BinaryInst::Add, v2, lh, v1});
-        dst = ctx->make_vreg();
-        ctx->push(new ShiftInst{ShiftInst::Ra, dst, v2, l});
+        if (nonneg) {
+            // the sign of x % d follows x only
+            dst = ctx->make_vreg();
+            if (is_mod) {
+                ctx->new_binary(BinaryInst::And, dst, lh, Operand::make_const(int(a - 1)));
+                return dst;
+            }
+            ctx->push(new ShiftInst{ShiftInst::Rl, dst, lh, l});
+        } else {
+            auto v0 = ctx->make_vreg();
+            ctx->push(new ShiftInst{ShiftInst::Ra, v0, lh, l - 1});
+            auto v1 = ctx->make_vreg();
+            ctx->push(new ShiftInst{ShiftInst::Rl, v1, v0, 32 - l});
+            auto v2 = ctx->make_vreg();
+            ctx->push(new BinaryInst{BinaryInst::Add, v2, lh, v1});
+            dst = ctx->make_vreg();
+            ctx->push(new ShiftInst{ShiftInst::Ra, dst, v2, l});
+        }
+        if (d < 0)
+            dst = build_neg_reg(dst, ctx);
     } else {
         using u64 = std::uint64_t;
         u64 t = 1ull << 31;
@@ -236,13 +242,18 @@ static Operand build_reg_div_const(Reg lh, int d, bool is_mod, Builder *ctx) {
         // dst = sign(d) * (is_neg(lh) + v2)
         // d > 0: dst = sgn + v2 = v2 - (-sgn)
         // d < 0: dst = -sgn - v2
-        dst = ctx->make_vreg();
-        auto v3 = ctx->make_vreg();
-        ctx->push(new ShiftInst{ShiftInst::Ra, v3, lh, 31});
-        if (d > 0)
-            ctx->push(new BinaryInst{BinaryInst::Sub, dst, v2, v3});
-        else
-            ctx->push(new BinaryInst{BinaryInst::Sub, dst, v3, v2});
+        // with lh non-negative, is_neg(lh) = 0
+        if (nonneg)
+            dst = d > 0 ? v2 : build_neg_reg(v2, ctx);
+        else {
+            dst = ctx->make_vreg();
+            auto v3 = ctx->make_vreg();
+            ctx->push(new ShiftInst{ShiftInst::Ra, v3, lh, 31});
+            if (d > 0)
+                ctx->push(new BinaryInst{BinaryInst::Sub, dst, v2, v3});
+            else
+                ctx->push(new BinaryInst{BinaryInst::Sub, dst, v3, v2});
+        }
     }
 
     if (!is_mod)
@@ -263,7 +274,7 @@ Operand ir::BinaryInst::build(mips::Builder *ctx) {
 
     if (op == tkd::Div || op == tkd::Mod) {
         if (rh.is_const())
-            return build_reg_div_const(lh, rh.val, op == tkd::Mod, ctx);
+            return build_reg_div_const(lh, rh.val, op == tkd::Mod, is_lhs_nonneg, ctx);
         auto dst = ctx->make_vreg();
         lh = ctx->ensure_reg(lh);
         rh = ctx->ensure_reg(rh);
@@ -4,6 +4,7 @@ using namespace mips;
 
 void bb_normalize(Func *f);
 void reg_alloc(Func *);
+void reg_alloc_linear(Func *);
 void reg_restore(Func *);
 void move_coalesce(Func *f);
 void dce(Func *f);
@@ -14,6 +15,8 @@ static Prog &operator << (Prog &lh, void (*rh)(Func *)) {
     return lh;
 }
 
+bool use_linear_scan = false;
+
 void run_mips_passes(Prog &prog, bool) {
     // TODO: non-opt
     Regs::init();
@@ -21,5 +24,5 @@ void run_mips_passes(Prog &prog, bool) {
     prog << bb_normalize
          // << dce  // slows down A-13 but speeds A-2
          << move_coalesce  // must preserve arg_loads & allocas7
-         << reg_alloc << dce << move_coalesce << dce << reg_restore;
+         << (use_linear_scan ? reg_alloc_linear : reg_alloc) << dce << move_coalesce << dce << reg_restore;
 }
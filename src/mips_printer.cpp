@@ -150,6 +150,8 @@ const char *bin_name_r(BinaryInst::Op op) {
             return "sltu";
         case BinaryInst::Xor:
             return "xor";
+        case BinaryInst::And:
+            return "and";
         case BinaryInst::Mul:
             return "mul";
         default:
@@ -167,6 +169,8 @@ const char *bin_name_i(BinaryInst::Op op) {
             return "sltiu";
         case BinaryInst::Xor:
             return "xori";
+        case BinaryInst::And:
+            return "andi";
         case BinaryInst::Mul:
             return "mul";  // XXX: pseudo inst used
         default:
@@ -6,7 +6,7 @@ void dce(Func *func) {
         auto live = bb->live_out;
         for (Inst *i = bb->insts.back, *prev; i; i = prev) {
             prev = i->prev;
-            auto def_use = get_def_use(i, func);
+            auto def_use = get_def_use_uncolored(i, func);
             auto &def = def_use.first;
             auto &use = def_use.second;
             if (def.size() == 1 && def.front().is_virtual() && !live.count(def.front()) && i->is_pure()) {
@@ -0,0 +1,218 @@
+#include "liveness.hpp"
+#include <algorithm>
+
+// Linear scan (Poletto & Sarkar) over the hulls of live intervals, trading code
+// quality for compile time against reg_alloc.
+// Insts are numbered 2k, with uses read at 2k and defs written at 2k + 1.
+
+namespace linear_scan {
+
+constexpr uint K = Regs::allocatable.size();
+
+struct Range {
+    uint from, to;  // inclusive
+};
+
+struct Interval {
+    Reg reg;
+    uint from, to;
+    uint color;
+    Reg hint;  // the other side of a move
+    bool is_temp;  // made by spill, never spilled again
+};
+
+struct Scanner {
+    Func *func;
+    uint temp_base;
+    vector<Interval> intervals;  // by vreg id
+    vector<Range> fixed[K];  // live ranges of machine regs, sorted
+    vector<Interval *> active, spilled;
+
+    void extend(const Reg &r, uint p) {
+        auto &x = intervals[r.val];
+        x.from = std::min(x.from, p);
+        x.to = std::max(x.to, p);
+    }
+
+    void build() {
+        intervals.assign(func->vreg_cnt, Interval{});
+        for (uint i = 0; i < func->vreg_cnt; ++i) {
+            auto &x = intervals[i];
+            x.reg = Reg::make_virtual(i);
+            x.from = -1u;
+            x.to = 0;
+            x.color = K;
+            x.hint = Reg::make_void();
+            x.is_temp = i >= temp_base;
+        }
+        for (auto &v: fixed)
+            v.clear();
+
+        uint pos = 0;
+        uint open[K];
+        FOR_BB (bb, *func) {
+            uint from = pos;
+            FOR_INST (i, *bb)
+                pos += 2;
+            uint to = pos;
+
+            std::fill(open, open + K, -1u);
+            for (auto r: bb->live_out) {
+                if (r.is_virtual())
+                    extend(r, to);
+                else
+                    open[Regs::inv_allocatable[r.val]] = to;
+            }
+            for (auto r: bb->live_in)
+                if (r.is_virtual())
+                    extend(r, from);
+
+            uint p = to;
+            for (Inst *i = bb->insts.back; i; i = i->prev) {
+                p -= 2;
+                auto def_use = get_def_use_uncolored(i, func);
+                for (auto &d: def_use.first) {
+                    if (d.is_virtual()) {
+                        extend(d, p + 1);
+                        continue;
+                    }
+                    uint c = Regs::inv_allocatable[d.val];
+                    fixed[c].push_back({p + 1, open[c] == -1u ? p + 1 : open[c]});
+                    open[c] = -1u;
+                }
+                for (auto &u: def_use.second) {
+                    if (u.is_virtual())
+                        extend(u, p);
+                    else {
+                        uint c = Regs::inv_allocatable[u.val];
+                        if (open[c] == -1u)
+                            open[c] = p;
+                    }
+                }
+                if_a (MoveInst, x, i) if (!(is_ignored(x->src) || is_ignored(x->dst))) {
+                    if (x->dst.is_virtual())
+                        intervals[x->dst.val].hint = x->src;
+                    if (x->src.is_virtual())
+                        intervals[x->src.val].hint = x->dst;
+                }
+            }
+            for (uint c = 0; c < K; ++c)
+                if (open[c] != -1u)
+                    fixed[c].push_back({from, open[c]});
+        }
+
+        for (auto &v: fixed)
+            std::sort(v.begin(), v.end(), [](const Range &a, const Range &b) {
+                return a.from < b.from;
+            });
+    }
+
+    bool conflicts(uint c, const Interval *x) const {
+        auto &v = fixed[c];
+        auto it = std::lower_bound(v.begin(), v.end(), x->from, [](const Range &r, uint p) {
+            return r.to < p;
+        });
+        return it != v.end() && it->from <= x->to;
+    }
+
+    uint hint_color(const Interval *x) const {
+        auto &h = x->hint;
+        if (h.is_machine())
+            return Regs::inv_allocatable[h.val];
+        if (h.is_virtual())
+            return intervals[h.val].color;
+        return K;
+    }
+
+    uint pick(const Interval *x, uint used) const {
+        uint h = hint_color(x);
+        if (h < K && !(used >> h & 1) && !conflicts(h, x))
+            return h;
+        for (uint c = 0; c < K; ++c)
+            if (!(used >> c & 1) && !conflicts(c, x))
+                return c;
+        return K;
+    }
+
+    void scan() {
+        vector<Interval *> order;
+        for (auto &x: intervals)
+            if (x.from != -1u)
+                order.push_back(&x);
+        std::stable_sort(order.begin(), order.end(), [](const Interval *a, const Interval *b) {
+            return a->from < b->from;
+        });
+
+        active.clear();
+        spilled.clear();
+        for (auto *x: order) {
+            vec_erase_if(active, [x](const Interval *a) {
+                return a->to < x->from;
+            });
+            uint used = 0;
+            for (auto *a: active)
+                used |= 1u << a->color;
+            uint c = pick(x, used);
+            if (c < K) {
+                infof(func->ir->name, "coloring", x->reg, "with", Regs::to_name(Regs::allocatable[c]));
+                x->color = c;
+                active.push_back(x);
+                continue;
+            }
+
+            // Spill the one ending last, whose reg x can take over
+            Interval *y = nullptr;
+            for (auto *a: active)
+                if (!a->is_temp && !conflicts(a->color, x) && (!y || a->to > y->to))
+                    y = a;
+            if (y && (x->is_temp || y->to > x->to)) {
+                infof(func->ir->name, "spilling", y->reg, "for", x->reg);
+                x->color = y->color;
+                y->color = K;
+                spilled.push_back(y);
+                *std::find(active.begin(), active.end(), y) = x;
+            } else {
+                asserts(!x->is_temp);
+                infof(func->ir->name, "spilling", x->reg);
+                spilled.push_back(x);
+            }
+        }
+    }
+
+    void run(Func *f) {
+        func = f;
+        temp_base = func->vreg_cnt;
+        build_liveness(func);
+        while (true) {
+            infof(func->ir->name + ": linear scan loop");
+            build();
+            scan();
+            if (spilled.empty())
+                break;
+            vector<bool> changed(func->bb_cnt);
+            vector<Reg> regs;
+            for (auto *x: spilled)
+                regs.push_back(x->reg);
+            spill(func, regs, changed, 0);
+            vector<BB *> bbs;
+            FOR_BB (bb, *func)
+                if (changed[bb->id])
+                    bbs.push_back(bb);
+            update_liveness(func, bbs, regs);
+        }
+
+        FOR_BB_INST (i, bb, *func)
+            for (auto *x: get_owned_regs(i)) if (x->is_virtual()) {
+                auto c = intervals[x->val].color;
+                asserts(c < K);
+                *x = Reg::make_machine(Regs::allocatable[c]);
+            }
+    }
+};
+
+}
+
+void reg_alloc_linear(Func *f) {
+    static linear_scan::Scanner s;
+    s.run(f);
+}
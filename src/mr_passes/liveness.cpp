@@ -159,39 +159,155 @@ std::pair<vector<Reg>, vector<Reg>> get_def_use_uncolored(Inst *i, Func *f) {
     return r;
 }
 
+static void build_use_def(BB *bb, Func *f) {
+    bb->use.clear();
+    bb->def.clear();
+    FOR_INST (i, *bb) {
+        auto use_def = get_def_use_uncolored(i, f);
+        for (auto &x: use_def.second) if (!bb->def.count(x))
+                bb->use.insert(x);
+        for (auto &x: use_def.first) if (!bb->use.count(x))
+                bb->def.insert(x);
+    }
+}
+
+static void build_po(BB *u, vector<bool> &vis, vector<BB *> &po) {
+    vis[u->id] = true;
+    for (auto *v: u->succ)
+        if (!vis[v->id])
+            build_po(v, vis, po);
+    po.push_back(u);
+}
+
+// wl is popped from the back, so bbs pushed in rpo are visited in postorder first
+static void solve(Func *f, vector<BB *> &&wl) {
+    vector<vector<BB *>> pred(f->bb_cnt);
+    FOR_BB (bb, *f)
+        for (auto *t: bb->succ)
+            pred[t->id].push_back(bb);
+    vector<bool> queued(f->bb_cnt);
+    for (auto *bb: wl)
+        queued[bb->id] = true;
+    while (!wl.empty()) {
+        auto *bb = wl.back();
+        wl.pop_back();
+        queued[bb->id] = false;
+        bb->live_out.clear();
+        for (auto *t: bb->succ)
+            bb->live_out.unite(t->live_in);
+        if (bb->live_in.assign_flow(bb->use, bb->live_out, bb->def))
+            for (auto *p: pred[bb->id]) if (!queued[p->id]) {
+                queued[p->id] = true;
+                wl.push_back(p);
+            }
+    }
+}
+
 // done: this may be unreliable, as bbs now are not "real" bbs, but can contain j/brs due to phi resolving
 // that's possibly why dce on machine regs cannot be performed
 // maybe we should add phi copies at the beginning of the source bb (tested to affect perf) or in a new inserted bb
 void build_liveness(Func *f) {
+    vector<bool> vis(f->bb_cnt);
+    vector<BB *> po;
+    build_po(f->bbs.front, vis, po);
     FOR_BB (bb, *f) {
-        bb->use.clear();
-        bb->def.clear();
-        bb->live_out.clear();
+        if (!vis[bb->id])
+            po.push_back(bb);
+        build_use_def(bb, f);
+        bb->live_in.clear();
+    }
+    std::reverse(po.begin(), po.end());
+    solve(f, std::move(po));
+}
 
-        FOR_INST (i, *bb) {
-            auto use_def = get_def_use_uncolored(i, f);
-            for (auto &x: use_def.second) if (!bb->def.count(x))
-                    bb->use.insert(x);
-            for (auto &x: use_def.first) if (!bb->use.count(x))
-                    bb->def.insert(x);
+// Spilling replaces the dropped regs with temporaries local to the changed bbs,
+// so liveness of the others is kept
+void update_liveness(Func *f, const vector<BB *> &changed, const vector<Reg> &dropped) {
+    FOR_BB (bb, *f)
+        for (auto &r: dropped) {
+            bb->live_in.erase(r);
+            bb->live_out.erase(r);
         }
+    for (auto *bb: changed)
+        build_use_def(bb, f);
+    solve(f, vector<BB *>(changed.rbegin(), changed.rend()));
+}
 
-        bb->live_in = bb->use;
+// Each reg is spilled into a new stack slot, with loads and stores of temporaries
+// around every chunk of insts in each bb
+void spill(Func *func, const vector<Reg> &regs, vector<bool> &changed, int chunk) {
+    struct Slot {
+        Reg reg;
+        int off;
+        Inst *first_use, *last_def;
+        Operand spiller;
+    };
+    vector<Slot> slots;
+    uint n = func->vreg_cnt;  // temporaries are made later
+    vector<uint> slot_of(n, -1u);
+    for (auto &r: regs) {
+        asserts(r.is_virtual());
+        infof("doing spilling for", r);
+        slot_of[r.val] = uint(slots.size());
+        int off = int((func->max_call_arg_num + func->alloca_num + func->spill_num++) << 2);
+        slots.push_back({r, off, nullptr, nullptr, Operand::make_void()});
     }
-    bool changed;
-    do {
-        changed = false;
-        FOR_BB (bb, *f) {
-            std::set<Reg> out;
-            for (auto *t: bb->succ)
-                out.insert(t->live_in.begin(), t->live_in.end());
-            if (out != bb->live_out) {
-                changed = true;
-                bb->live_out = std::move(out);
-                bb->live_in = bb->use;
-                for (auto &x: bb->live_out) if (!bb->def.count(x))
-                        bb->live_in.insert(x);
+    auto get_slot = [&](const Reg &r) -> Slot * {
+        if (r.is_virtual() && uint(r.val) < n && slot_of[r.val] != -1u)
+            return &slots[slot_of[r.val]];
+        return nullptr;
+    };
+
+    vector<Slot *> touched;
+    FOR_BB (bb, *func) {
+        auto cp = [&]() {
+            for (auto *s: touched) {
+                if (s->first_use) {
+                    infof("use", s->spiller, "for spilled", s->reg, "at", s->off);
+                    bb->insts.insert(s->first_use, new LoadInst{
+                        s->spiller, Reg::make_machine(Regs::sp), s->off
+                    });
+                    s->first_use = nullptr;
+                }
+                if (s->last_def) {
+                    infof("def", s->spiller, "for spilled", s->reg, "at", s->off);
+                    bb->insts.insert_after(s->last_def, new StoreInst{
+                        s->spiller, Reg::make_machine(Regs::sp), s->off
+                    });
+                    s->last_def = nullptr;
+                }
+                s->spiller.kind = Operand::Void;
+            }
+            touched.clear();
+        };
+        auto get_spiller = [&](Slot *s) {
+            if (s->spiller.is_void()) {
+                s->spiller = func->make_vreg();
+                touched.push_back(s);
+            }
+            return s->spiller;
+        };
+        int cnt = 0;
+        FOR_INST (i, *bb) {
+            auto def_use = get_owned_def_use(i);
+            // uses go first for insts like `addu r, r, 1`
+            for (auto *use: def_use.second) if (auto *s = get_slot(*use)) {
+                *use = get_spiller(s);
+                changed[bb->id] = true;
+                if (!s->first_use && !s->last_def)
+                    s->first_use = i;
+            }
+            auto *def = def_use.first;
+            if (def) if (auto *s = get_slot(*def)) {
+                *def = get_spiller(s);
+                changed[bb->id] = true;
+                s->last_def = i;
+            }
+            if (cnt++ >= chunk) {
+                cp();
+                cnt = 0;
             }
         }
-    } while (changed);
+        cp();
+    }
 }
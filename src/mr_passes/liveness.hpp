@@ -15,3 +15,5 @@ vector<Reg> get_def(Inst *i);
 bool is_ignored(const Operand &x);
 std::pair<vector<Reg>, vector<Reg>> get_def_use_uncolored(Inst *i, Func *f);
 void build_liveness(Func *f);
+void update_liveness(Func *f, const vector<BB *> &changed, const vector<Reg> &dropped);
+void spill(Func *f, const vector<Reg> &regs, vector<bool> &changed, int chunk);
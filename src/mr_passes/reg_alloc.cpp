@@ -3,72 +3,113 @@
 #include <bitset>
 #include <cmath>
 
-using std::set;
-using std::unordered_map;
-
 namespace reg_allocater {
 
 constexpr uint K = Regs::allocatable.size();
 
+// Indexed as in RegSet, where the worklist or set holding a node is its state
 struct Node {
+    enum State {
+        Unused, Initial, Precolored, Simplify, Freeze, Spill, Coalesced, Selected
+    } state = Unused;
     Operand reg;
     uint degree = 0, color = 0x7f, depth = 0;
     Node *alias = nullptr;
-    std::set<Node *> adj_list;
-    std::set<MoveInst *> move_list;
+    vector<Node *> adj_list;
+    vector<uint> move_list;  // indices into moves
+    uint mark = 0;  // by conservative
     bool colored = false;  // colored_nodes
     bool selected_spill = false;
+    bool is_temp = false;  // made by spill, which is never worth spilling again
 
     double weight() const {
-        return degree / std::pow(2.0, depth);
+        return is_temp ? -1 : degree / std::pow(2.0, depth);
     }
 };
 
-template <class T>
-void insert_all(set<T> &dst, const set<T> &src) {
-    for (auto &x: src)
-        dst.insert(x);
-}
+struct Move {
+    enum State {
+        Worklist, Active, Coalesced, Constrained, Frozen
+    } state;
+    Operand dst, src;
+    int depth;
+};
 
 struct Allocater {
     Func *func;
-    unordered_map<Operand, Node> nodes;
-    vector<Node *> select_stack;
-    set<MoveInst *> wl_moves;
-    set<Node *> spilled_nodes, coalesced_nodes, spill_wl, freeze_wl, simplify_wl;
-
-    void clear() {
-        nodes.clear();
+    uint temp_base;
+    vector<Node> nodes;
+    vector<uint64_t> adj_set;  // lower triangular bit matrix
+    vector<Move> moves;
+    vector<Node *> select_stack, spilled_nodes;
+    // Worklists are popped lazily, skipping entries whose states are changed
+    vector<uint> wl_moves;
+    vector<Node *> simplify_wl, freeze_wl, spill_wl;
+    uint mark_clock;
+    vector<BB *> spilled_bbs;  // changed by rewrite_program, for update_liveness
+    vector<Reg> spilled_regs;
+
+    void init() {
+        uint n = 32 + func->vreg_cnt;
+        nodes.assign(n, Node{});
+        adj_set.assign((uint64_t(n) * (n - 1) / 2 + 63) >> 6, 0);
+        moves.clear();
         select_stack.clear();
-        wl_moves.clear();
         spilled_nodes.clear();
-        coalesced_nodes.clear();
-        spill_wl.clear();
-        freeze_wl.clear();
+        wl_moves.clear();
         simplify_wl.clear();
+        freeze_wl.clear();
+        spill_wl.clear();
+        mark_clock = 0;
+
+        for (uint r: Regs::allocatable) {
+            auto *u = get_node(Reg::make_machine(r));
+            u->state = Node::Precolored;
+            u->degree = 0x7fffffff;
+        }
     }
 
-    Node *get_node(Operand r) {
-        auto &u = nodes[r];
-        u.reg = r;
+    Node *get_node(const Reg &r) {
+        auto &u = nodes[RegSet::index(r)];
+        if (u.state == Node::Unused) {
+            u.state = Node::Initial;
+            u.reg = r;
+            u.is_temp = r.is_virtual() && uint(r.val) >= temp_base;
+        }
         return &u;
     }
 
-    static void add_edge(Node *u, Node *v) {
-        asserts(u->reg.is_uncolored());
-        asserts(v->reg.is_uncolored());
-        // asserts(u->reg.is_virtual() || v->reg.is_virtual());
-        // TODO: adj_set
-        if (u == v || u->adj_list.count(v))
+    uint64_t edge_bit(const Node *u, const Node *v) const {
+        uint64_t i = u - nodes.data(), j = v - nodes.data();
+        if (i < j)
+            std::swap(i, j);
+        return i * (i - 1) / 2 + j;
+    }
+
+    bool adjacent_to(const Node *u, const Node *v) const {
+        if (u == v)
+            return false;
+        uint64_t k = edge_bit(u, v);
+        return adj_set[k >> 6] >> (k & 63) & 1;
+    }
+
+    void add_edge(Node *u, Node *v) {
+        if (u == v)
+            return;
+        uint64_t k = edge_bit(u, v);
+        auto &w = adj_set[k >> 6];
+        uint64_t b = uint64_t(1) << (k & 63);
+        if (w & b)
             return;
-        if (!u->reg.is_machine()) {
+        w |= b;
+        if (u->state != Node::Precolored) {
             infof("adding v", v->reg, "to adj of u", u->reg);
-            u->adj_list.insert(v);
+            u->adj_list.push_back(v);
             ++u->degree;
         }
-        if (!v->reg.is_machine()) {
+        if (v->state != Node::Precolored) {
             infof("adding u", u->reg, "to adj of v", v->reg);
-            v->adj_list.insert(u);
+            v->adj_list.push_back(u);
             ++v->degree;
         }
     }
@@ -81,29 +122,21 @@ struct Allocater {
                 auto def_use = get_def_use_uncolored(i, func);
                 auto &def = def_use.first;
                 auto &use = def_use.second;
-                /*
-                if (def.size() == 1 && def.front().is_virtual() && !live.count(def.front()) && i->is_pure()) {
-                    infof("erasing", *i);
-                    bb->insts.erase(i);
-                    delete i;
-                    continue;
-                }*/
                 if_a (MoveInst, x, i) if (!(is_ignored(x->src) || is_ignored(x->dst))) {
                     auto *u = get_node(x->src), *v = get_node(x->dst);
-                    x->active = false;  // initialize active_moves
                     live.erase(x->src);
-                    u->move_list.insert(x);
-                    v->move_list.insert(x);
-                    wl_moves.insert(x);
+                    uint m = moves.size();
+                    moves.push_back({Move::Worklist, x->dst, x->src, bb->loop_depth});
+                    u->move_list.push_back(m);
+                    v->move_list.push_back(m);
                 }
                 for (auto &d: def)
                     live.insert(d);  // the point is to insert them all to the graph
-                for (auto &d: def)
-                    for (auto &l: live) {
-                        //if (d != l)
-                        //    infof(func->ir->name, ": building edge &", d, '&', l);
-                        add_edge(get_node(l), get_node(d));
-                    }
+                for (auto &d: def) {
+                    auto *v = get_node(d);
+                    for (auto l: live)
+                        add_edge(get_node(l), v);
+                }
                 for (auto &d: def) {
                     live.erase(d);
                     get_node(d)->depth += bb->loop_depth;
@@ -114,206 +147,223 @@ struct Allocater {
                 }
             }
         }
+
+        // Popped from the back, so moves in deeper loops are tried first
+        for (uint m = 0; m < moves.size(); ++m)
+            wl_moves.push_back(m);
+        std::stable_sort(wl_moves.begin(), wl_moves.end(), [&](uint a, uint b) {
+            return moves[a].depth < moves[b].depth;
+        });
     }
 
-    set<Node *> adjacent(Node *u) {
-        set<Node *> r;
+    template <class F>
+    void for_adjacent(Node *u, F f) {
         for (auto *x: u->adj_list)
-            if (
-                std::find(select_stack.begin(), select_stack.end(), x) == select_stack.end() &&
-                !coalesced_nodes.count(x)
-            )
-                r.insert(x);
-        return r;
+            if (x->state != Node::Selected && x->state != Node::Coalesced)
+                f(x);
     }
 
-    set<MoveInst *> node_moves(Node *u) const {
-        set<MoveInst *> r;
-        for (auto *x: u->move_list)
-            if (x->active || wl_moves.count(x))
-                r.insert(x);
-        return r;
+    bool is_move_pending(uint m) const {
+        return moves[m].state == Move::Worklist || moves[m].state == Move::Active;
     }
 
     bool move_related(Node *u) const {
-        return std::any_of(u->move_list.begin(), u->move_list.end(), [&](MoveInst *x) {
-            return x->active || wl_moves.count(x);
+        return std::any_of(u->move_list.begin(), u->move_list.end(), [&](uint m) {
+            return is_move_pending(m);
         });
     }
 
+    void push_wl(Node *u, Node::State s) {
+        u->state = s;
+        if (s == Node::Simplify)
+            simplify_wl.push_back(u), infof("adding", u->reg, "to simplify_wl");
+        else if (s == Node::Freeze)
+            freeze_wl.push_back(u), infof("adding", u->reg, "to freeze_wl");
+        else
+            spill_wl.push_back(u), infof("adding", u->reg, "to spill_wl");
+    }
+
+    static Node *pop_wl(vector<Node *> &wl, Node::State s) {
+        while (!wl.empty()) {
+            auto *u = wl.back();
+            wl.pop_back();
+            if (u->state == s)
+                return u;
+        }
+        return nullptr;
+    }
+
     void make_wl() {
-        for (uint i = 0; i < func->vreg_cnt; ++i) {
-            auto it = nodes.find(Reg::make_virtual(i));
-            if (it == nodes.end())
+        for (uint i = 32; i < nodes.size(); ++i) {
+            auto *u = &nodes[i];
+            if (u->state != Node::Initial)
                 continue;
-            auto &u = it->second;
-            if (u.degree >= K)
-                spill_wl.insert(&u), infof("adding", u.reg, "to spill_wl");
-            else if (move_related(&u))
-                freeze_wl.insert(&u), infof("adding", u.reg, "to freeze_wl");
+            if (u->degree >= K)
+                push_wl(u, Node::Spill);
+            else if (move_related(u))
+                push_wl(u, Node::Freeze);
             else
-                simplify_wl.insert(&u), infof("adding", u.reg, "to simplify_wl");
+                push_wl(u, Node::Simplify);
         }
     }
 
-    void simplify() {
-        auto it = simplify_wl.begin();
-        auto u = *it;
+    void simplify(Node *u) {
         infof("simplifying", u->reg, "with deg", u->degree);
-        simplify_wl.erase(it);
+        u->state = Node::Selected;
         select_stack.push_back(u);
-        for (auto *v: adjacent(u))
+        for_adjacent(u, [&](Node *v) {
             dec_degree(v);
+        });
     }
 
     void dec_degree(Node *u) {
+        if (u->state == Node::Precolored)
+            return;
         if (u->degree-- == K) {
             enable_moves(u);
-            for (auto *v: adjacent(u))
+            for_adjacent(u, [&](Node *v) {
                 enable_moves(v);
-            spill_wl.erase(u);
-            if (move_related(u))
-                freeze_wl.insert(u), infof("dec_deg inserting", u->reg, "to freeze_wl");
-            else
-                simplify_wl.insert(u), infof("dec_deg inserting", u->reg, "to simplify_wl");
+            });
+            if (u->state == Node::Spill)
+                push_wl(u, move_related(u) ? Node::Freeze : Node::Simplify);
         }
     }
 
-    // inner subroutine
     void enable_moves(Node *u) {
-        for (auto *m: node_moves(u)) if (m->active) {
-            m->active = false;
-            wl_moves.erase(m);
-        }
+        for (uint m: u->move_list)
+            if (moves[m].state == Move::Active) {
+                moves[m].state = Move::Worklist;
+                wl_moves.push_back(m);
+            }
     }
 
-    void coalesce() {
-        auto it = wl_moves.begin();
-        auto *m = *it;
-        auto *u = get_alias(&nodes[m->dst]);
-        auto *v = get_alias(&nodes[m->src]);
-        asserts(move_related(&nodes[m->dst]) && move_related(&nodes[m->src]));
-        if (m->src.is_machine())
+    void coalesce(uint mi) {
+        auto &m = moves[mi];
+        auto *u = get_alias(get_node(m.dst));
+        auto *v = get_alias(get_node(m.src));
+        if (v->state == Node::Precolored)
             std::swap(u, v);
-        wl_moves.erase(it);
         if (u == v) {
-            // coalesced_moves is unused
             infof("coalesced_moves, add only", u->reg);
+            m.state = Move::Coalesced;
             add_wl(u);
             return;
         }
-        if (v->reg.is_machine() || u->adj_list.count(v) || v->adj_list.count(u)) {
-            // constrained_moves is unused
+        if (v->state == Node::Precolored || adjacent_to(u, v)) {
             infof("constrained_moves, add both", u->reg, "and", v->reg);
+            m.state = Move::Constrained;
             add_wl(u);
             add_wl(v);
             return;
         }
-        bool u_precolored = u->reg.is_machine();
-        auto ad = adjacent(v);
-        if ((u_precolored && std::all_of(ad.begin(), ad.end(),
-             [&](Node *t) {
-                return ok(t, u);
-             })) || (!u_precolored && (insert_all(ad, adjacent(u)), conservative(ad)))) {
+        bool can;
+        if (u->state == Node::Precolored) {
+            can = true;
+            for_adjacent(v, [&](Node *t) {
+                can = can && ok(t, u);
+            });
+        } else
+            can = conservative(u, v);
+        if (can) {
             infof("combining move, add left", u->reg);
+            m.state = Move::Coalesced;
             combine(u, v);
             add_wl(u);
         } else
-            m->active = true;
+            m.state = Move::Active;
     }
 
     void add_wl(Node *u) {
-        if (!u->reg.is_machine() && u->degree < K && !move_related(u)) {
+        if (u->state == Node::Freeze && u->degree < K && !move_related(u)) {
             infof("add_wl", u->reg);
-            freeze_wl.insert(u);
-            simplify_wl.insert(u);
+            push_wl(u, Node::Simplify);
         }
     }
 
-    static bool ok(Node *t, Node *r) {
-        return t->degree < K || t->reg.is_machine() || t->adj_list.count(r) || r->adj_list.count(t);
+    bool ok(Node *t, Node *r) const {
+        return t->degree < K || t->state == Node::Precolored || adjacent_to(t, r);
     }
 
-    static bool conservative(set<Node *> s) {
+    // Briggs, counting common neighbours once
+    bool conservative(Node *u, Node *v) {
         uint k = 0;
-        for (auto *u: s)
-            if (u->degree >= K && ++k >= K)
-                return false;
-        return true;
+        ++mark_clock;
+        auto count = [&](Node *t) {
+            if (t->mark != mark_clock) {
+                t->mark = mark_clock;
+                if (t->degree >= K)
+                    ++k;
+            }
+        };
+        for_adjacent(u, count);
+        for_adjacent(v, count);
+        return k < K;
     }
 
-    Node *get_alias(Node *u) {
-        while (coalesced_nodes.count(u))
+    static Node *get_alias(Node *u) {
+        while (u->state == Node::Coalesced)
             u = u->alias;
         return u;
     }
 
     void combine(Node *u, Node *v) {
         infof(func->ir->name, "combining", u->reg, "with", v->reg);
-        if (!freeze_wl.erase(v))
-            spill_wl.erase(v);
-        coalesced_nodes.insert(v);
+        v->state = Node::Coalesced;
         v->alias = u;
-        // typo?
-        insert_all(u->move_list, v->move_list);
-        for (Node *t: adjacent(v)) {
-            // infof("so connect", t->reg, "to", u->reg);
+        u->move_list.insert(u->move_list.end(), v->move_list.begin(), v->move_list.end());
+        enable_moves(v);
+        for_adjacent(v, [&](Node *t) {
             add_edge(t, u);
             dec_degree(t);
-        }
-        if (u->degree >= K && freeze_wl.erase(u))
-            spill_wl.insert(u);
+        });
+        if (u->degree >= K && u->state == Node::Freeze)
+            push_wl(u, Node::Spill);
     }
 
-    void freeze() {
-        auto it = freeze_wl.begin();
-        auto *u = *it;
-        freeze_wl.erase(it);
+    void freeze(Node *u) {
         infof("freezing", u->reg);
-        simplify_wl.insert(u);
+        push_wl(u, Node::Simplify);
         freeze_moves(u);
     }
 
     void freeze_moves(Node *u) {
-        for (auto *m: node_moves(u)) {
-            if (m->active)
-                m->active = false;
-            else
-                wl_moves.erase(m);
-            // frozen_moves is unused
-            auto v = get_alias(&nodes[m->src]);
+        for (uint mi: u->move_list) {
+            if (!is_move_pending(mi))
+                continue;
+            auto &m = moves[mi];
+            m.state = Move::Frozen;
+            auto *v = get_alias(get_node(m.src));
             if (v == u)
-            // if (vx == u->reg)
-                v = get_alias(&nodes[m->dst]);
-            else
-                asserts(get_alias(&nodes[m->dst]) == u);
-            // asserts(nodes.find(vx) != nodes.end());
-            // auto *v = &nodes[vx];
-            if (!move_related(v) && v->degree < K) {
+                v = get_alias(get_node(m.dst));
+            if (v->state == Node::Freeze && !move_related(v) && v->degree < K) {
                 infof("move", v->reg, "from freeze_wl to simplify_wl, with u", u->reg);
-                freeze_wl.erase(v);
-                simplify_wl.insert(v);
+                push_wl(v, Node::Simplify);
             }
         }
     }
 
-    void select_spill() {
-        auto it = std::max_element(spill_wl.begin(), spill_wl.end(), [](const Node *a, const Node *b) {
-            return a->weight() < b->weight();
-        });
-        // auto it = spill_wl.begin();
-        auto *u = *it;
+    bool select_spill() {
+        Node *u = nullptr;
+        uint n = 0;
+        for (auto *v: spill_wl)
+            if (v->state == Node::Spill) {
+                spill_wl[n++] = v;
+                if (!u || v->weight() > u->weight())
+                    u = v;
+            }
+        spill_wl.resize(n);
+        if (!u)
+            return false;
         infof("selecting spill", u->reg, "weighted", u->weight());
         asserts(u->reg.is_virtual());
-        spill_wl.erase(it);
-        simplify_wl.insert(u);
+        push_wl(u, Node::Simplify);
         freeze_moves(u);
         u->selected_spill = true;
+        return true;
     }
 
-    uint get_color(Node *u) {
-        asserts(u->reg.is_uncolored());
-        if (u->reg.is_machine())
+    static uint get_color(Node *u) {
+        if (u->state == Node::Precolored)
             return Regs::inv_allocatable[u->reg.val];
         if (u->colored)
             return u->color;
@@ -321,19 +371,13 @@ struct Allocater {
     }
 
     void color(Node *u) {
-        // bool ok_colors[K];
         std::bitset<K> ok_colors;
-        // std::fill(ok_colors, ok_colors + K, true);
         ok_colors.set();
         for (auto *v: u->adj_list) {
             uint c = get_color(get_alias(v));
-            if (c < K) {
-                // if (ok_colors.test(c))
-                //     warnf(func->ir->name, "color", c, Regs::to_name(Regs::allocatable[c]), "is taken for", u->reg);
+            if (c < K)
                 ok_colors.reset(c);
-            }
         }
-        // ok_colors[c] = false;
         if (ok_colors.count()) {
             u->colored = true;
             u->color = K;
@@ -345,7 +389,7 @@ struct Allocater {
             asserts(u->color < K);
         } else {
             infof(func->ir->name, "spilling", u->reg);
-            spilled_nodes.insert(u);
+            spilled_nodes.push_back(u);
         }
     }
 
@@ -367,124 +411,75 @@ struct Allocater {
             color(u);
         }
 
-        for (auto *u: coalesced_nodes) {
-            auto *a = get_alias(u);
-            u->color = get_color(a);
-            // asserts(u->color < K);
-            if (u->color >= K) {
-                asserts(spilled_nodes.count(a));
-                continue;
-            }
-            infof(func->ir->name, "coalesce coloring", u->reg, "with", Regs::to_name(Regs::allocatable[u->color]),
-                  u->color, "just as", a->reg, "whose color is also", a->color);
-            u->colored = true;
+        // Colors are dropped when spilling, which keeps the regs that are not spilled
+        // and thus their liveness for update_liveness
+        if (!spilled_nodes.empty())
+            return;
+
+        for (auto &u: nodes) if (u.state == Node::Coalesced) {
+            auto *a = get_alias(&u);
+            u.color = get_color(a);
+            asserts(u.color < K);
+            infof(func->ir->name, "coalesce coloring", u.reg, "with", Regs::to_name(Regs::allocatable[u.color]),
+                  u.color, "just as", a->reg, "whose color is also", a->color);
+            u.colored = true;
         }
 
         FOR_BB_INST (i, bb, *func) {
-            for (auto *x: get_owned_regs(i)) {
-                auto it = nodes.find(*x);
-                if (it != nodes.end()) {
-                    auto &u = it->second;
-                    if (x->is_machine())
-                        x->kind = Reg::Machine;
-                    else if (u.colored) {
-                        infof("replacing", u.reg, *x);
-                        *x = Reg::make_machine(Regs::allocatable[u.color]);
-                        infof("to", *x);
-                    }
+            for (auto *x: get_owned_regs(i)) if (x->is_virtual()) {
+                auto &u = nodes[RegSet::index(*x)];
+                if (u.colored) {
+                    infof("replacing", u.reg, *x);
+                    *x = Reg::make_machine(Regs::allocatable[u.color]);
+                    infof("to", *x);
                 }
             }
         }
     }
 
     void rewrite_program() {
-        for (auto &u: spilled_nodes)
-            spill(u->reg);
-    }
-
-    void spill(Reg r) {
-        infof("doing spilling for", r);
-        int off = int((func->max_call_arg_num + func->alloca_num + func->spill_num) << 2);
-        FOR_BB (bb, *func) {
-            Inst *first_use = nullptr, *last_def = nullptr;
-            Operand spiller;
-            auto cp = [&]() {
-                if (first_use) {
-                    asserts(spiller.is_virtual());
-                    infof("use", spiller, "for spilled", r, "at", off);
-                    bb->insts.insert(first_use, new LoadInst{
-                        spiller, Reg::make_machine(Regs::sp), off
-                    });
-                    first_use = nullptr;
-                }
-                if (last_def) {
-                    asserts(spiller.is_virtual());
-                    infof("def", spiller, "for spilled", r, "at", off);
-                    bb->insts.insert_after(last_def, new StoreInst{
-                        spiller, Reg::make_machine(Regs::sp), off
-                    });
-                    last_def = nullptr;
-                }
-                spiller.kind = Operand::Void;
-            };
-            int cnt = 0;
-            FOR_INST (i, *bb) {
-                auto def_use = get_owned_def_use(i);
-                auto *def = def_use.first;
-                if (def && *def == r) {
-                    if (spiller.is_void())
-                        spiller = func->make_vreg();
-                    *def = spiller;
-                    last_def = i;
-                }
-                for (auto *use: def_use.second) if (*use == r) {
-                    if (spiller.is_void())
-                        spiller = func->make_vreg();
-                    *use = spiller;
-                    if (!first_use && !last_def)
-                        first_use = i;
-                }
-                if (cnt++ > 30) {
-                    cp();
-                    cnt = 0;
-                }
-            }
-            cp();
-        }
-        ++func->spill_num;
+        spilled_bbs.clear();
+        spilled_regs.clear();
+        vector<bool> changed(func->bb_cnt);
+        for (auto *u: spilled_nodes)
+            spilled_regs.push_back(u->reg);
+        spill(func, spilled_regs, changed, 31);
+        FOR_BB (bb, *func)
+            if (changed[bb->id])
+                spilled_bbs.push_back(bb);
     }
 
     void run(Func *f) {
         func = f;
+        temp_base = func->vreg_cnt;
+        build_liveness(func);
         while (true) {
-            clear();
             infof(func->ir->name + ": reg alloc loop");
-            build_liveness(func);
-
-            for (uint i = 0; i < K; ++i) if (Regs::inv_allocatable[i] < 32)
-                get_node(Reg::make_machine(i))->degree = 0x7fffffff;
-
+            init();
             build();
             make_wl();
 
-            do {
+            while (true) {
                 info("reg alloc inner loop");
-                if (!simplify_wl.empty())
-                    simplify();
-                else if (!wl_moves.empty())
-                    coalesce();
-                else if (!freeze_wl.empty())
-                    freeze();
-                else if (!spill_wl.empty())
-                    select_spill();
-            } while (!(simplify_wl.empty() && wl_moves.empty() && freeze_wl.empty() && spill_wl.empty()));
+                if (auto *u = pop_wl(simplify_wl, Node::Simplify))
+                    simplify(u);
+                else if (!wl_moves.empty()) {
+                    uint m = wl_moves.back();
+                    wl_moves.pop_back();
+                    if (moves[m].state == Move::Worklist)
+                        coalesce(m);
+                } else if (auto *u = pop_wl(freeze_wl, Node::Freeze))
+                    freeze(u);
+                else if (!select_spill())
+                    break;
+            }
             info("inner loop ended");
             assign_colors();
             if (spilled_nodes.empty())
                 break;
             infof(spilled_nodes.size(), "nodes are to be spilled");
             rewrite_program();
-            clear();
+            update_liveness(func, spilled_bbs, spilled_regs);
         }
     }
 };
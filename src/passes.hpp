@@ -5,3 +5,7 @@
 
 void run_passes(ir::Prog &prog, bool opt = true);
 void run_mips_passes(mips::Prog &prog, bool opt = true);
+
+extern bool use_linear_scan;  // reg_alloc_linear in place of reg_alloc, by --linear-scan
+extern bool use_memoize;  // memo for recursive pure functions, by --memoize
+extern bool use_pe;  // pe of main, by --pe
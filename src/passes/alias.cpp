@@ -0,0 +1,122 @@
+#include "ir_common.hpp"
+
+// Bases are resolved through GEP chains to the underlying objects, which are
+// allocas, globals, or any array passed as an argument.
+
+MemLoc get_loc(MemInst *x) {
+    MemLoc r{nullptr, x->base.value, 0, false, false};
+    if_a (Const, c, x->off.value) {
+        r.off = c->val;
+        r.has_off = true;
+    }
+    auto *v = r.base;
+    int off = r.off;
+    bool exact = r.has_off;
+    while (auto *g = as_a<GEPInst>(v)) {
+        if_a (Const, c, g->off.value)
+            off += c->val * g->size;
+        else
+            exact = false;
+        v = g->base.value;
+    }
+    if (is_a<AllocaInst>(v) || is_a<Global>(v) || is_a<Argument>(v)) {
+        r.obj = v;
+        if (exact) {
+            r.base = v;
+            r.off = off;
+            r.is_exact = true;
+        }
+    }
+    return r;
+}
+
+static bool is_scalar(Value *obj) {
+    if_a (Global, x, obj)
+        return x->var->dims.empty();
+    if_a (AllocaInst, x, obj)
+        return x->var->dims.empty();
+    return false;
+}
+
+// Phis of pointers are only made by sr and tre, with the start in the first
+// val and the same object in the others
+Value *get_obj(Value *v) {
+    while (true) {
+        if_a (GEPInst, x, v)
+            v = x->base.value;
+        else if_a (PhiInst, x, v)
+            v = x->vals.front().first.value;
+        else
+            break;
+    }
+    if (is_a<AllocaInst>(v) || is_a<Global>(v) || is_a<Argument>(v))
+        return v;
+    return nullptr;
+}
+
+static bool may_share(Value *a, Value *b) {
+    if (!a || !b || a == b)
+        return true;
+    bool arg_a = is_a<Argument>(a), arg_b = is_a<Argument>(b);
+    if (arg_a != arg_b) {
+        // Arrays passed in never point to the frame of this call, nor to scalars
+        auto *o = arg_a ? b : a;
+        return is_a<Global>(o) && !is_scalar(o);
+    }
+    return arg_a;
+}
+
+static bool may_overlap(const MemLoc &a, const MemLoc &b) {
+    return !(a.base == b.base && a.has_off && b.has_off && a.off != b.off);
+}
+
+bool may_alias(const MemLoc &a, const MemLoc &b) {
+    return may_share(a.obj, b.obj) && may_overlap(a, b);
+}
+
+bool may_alias(MemInst *a, MemInst *b) {
+    return may_alias(get_loc(a), get_loc(b));
+}
+
+// By the mod/ref sets of the callee, where its array params are mapped to
+// the args passed
+uint get_mod_ref(CallInst *c, const MemLoc &l) {
+    auto *f = c->func;
+    if (!l.obj)
+        return mr::ModRef;
+    uint r = mr::None;
+    auto add = [&](bool mod, bool ref) {
+        if (mod)
+            r |= mr::Mod;
+        if (ref)
+            r |= mr::Ref;
+    };
+    if_a (Global, x, l.obj)
+        add(f->mod_globals.count(x->var), f->ref_globals.count(x->var));
+    else if (is_a<Argument>(l.obj)) {
+        for (auto *d: f->mod_globals)
+            add(!d->dims.empty(), false);
+        for (auto *d: f->ref_globals)
+            add(false, !d->dims.empty());
+    }
+    for (uint k = 0; k < f->mod_params.size(); ++k)
+        if ((f->mod_params[k] || f->ref_params[k]) && may_share(get_obj(c->args[k].value), l.obj))
+            add(f->mod_params[k], f->ref_params[k]);
+    return r;
+}
+
+uint get_mod_ref(CallInst *c, MemInst *x) {
+    return get_mod_ref(c, get_loc(x));
+}
+
+// Within the object, so it can be hoisted out of any guard
+bool is_safe_to_speculate(const MemLoc &l) {
+    if (!l.is_exact || l.off < 0 || l.off % 4)
+        return false;
+    const Decl *d = nullptr;
+    if_a (Global, x, l.obj)
+        d = x->var;
+    else if_a (AllocaInst, x, l.obj)
+        d = x->var;
+    return d && uint(l.off) < d->size() * 4;
+}
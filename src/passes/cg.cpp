@@ -1,5 +1,40 @@
 #include "ir_common.hpp"
 
+// Adds the object accessed to the mod or ref set of f
+static bool add_access(Func *f, Value *obj, bool mod) {
+    asserts(obj);
+    if_a (Global, x, obj) {
+        if (x->var->is_const)
+            return false;
+        return (mod ? f->mod_globals : f->ref_globals).insert(x->var).second;
+    }
+    if_a (Argument, x, obj) {
+        auto &s = mod ? f->mod_params : f->ref_params;
+        if (s[x->pos])
+            return false;
+        s[x->pos] = true;
+        return true;
+    }
+    return false;  // locals are never seen by callers
+}
+
+// What the callee of c accesses, as seen from f
+static bool add_call(Func *f, CallInst *c) {
+    auto *g = c->func;
+    bool res = false;
+    for (auto *d: g->mod_globals)
+        res = f->mod_globals.insert(d).second || res;
+    for (auto *d: g->ref_globals)
+        res = f->ref_globals.insert(d).second || res;
+    for (uint k = 0; k < g->mod_params.size(); ++k) {
+        if (g->mod_params[k])
+            res = add_access(f, get_obj(c->args[k].value), true) || res;
+        if (g->ref_params[k])
+            res = add_access(f, get_obj(c->args[k].value), false) || res;
+    }
+    return res;
+}
+
 // TODO: affects A-13, A-14 even when doing nothing
 void cg(Prog *p) {
     for (auto &f: p->funcs) {
@@ -8,30 +43,39 @@ void cg(Prog *p) {
         f.has_side_effects = false;
         f.has_global_loads = false;
         f.has_param_loads = false;
+        f.mod_globals.clear();
+        f.ref_globals.clear();
+        f.mod_params.assign(f.params.size(), false);
+        f.ref_params.assign(f.params.size(), false);
     }
+    vector<vector<CallInst *>> calls(p->funcs.size());
     for (auto &f: p->funcs) {
         FOR_BB_INST (i, bb, f) {
+            if (is_a<StoreInst>(i) || is_a<LoadInst>(i))
+                add_access(&f, get_obj(static_cast<MemInst *>(i)->base.value), is_a<StoreInst>(i));
             if_a (CallInst, x, i) {
                 x->func->callers.insert(&f);
+                calls[&f - p->funcs.data()].push_back(x);
                 if (x->func->has_side_effects)
                     f.has_side_effects = true;
                 if (!x->uses.empty())
                     x->func->used_callers.insert(&f);
             } else if_a (StoreInst, x, i) {
-                if (!f.has_side_effects && (x->lhs->is_global ||
+                // Memo tables are only seen by their functions, which stay pure
+                if (!f.has_side_effects && ((x->lhs->is_global && !x->lhs->is_memo) ||
                     (!x->lhs->dims.empty() && x->lhs->dims.front() < 0)
                     ))
                     f.has_side_effects = true;
             } else if_a (LoadInst, x, i) {
                 if (x->lhs->is_global) {
-                    if (!x->lhs->is_const)
+                    if (!x->lhs->is_const && !x->lhs->is_memo)
                         f.has_global_loads = true;
-                } else if_a (Argument, a, x->base.value) {
+                } else if_a (Argument, a, get_obj(x->base.value)) {
                     asserts(!a->var->dims.empty() && a->var->dims[0] == -1);
                     f.has_param_loads = true;
                 }
             } else if_a (GEPInst, x, i) {
-                if_a (Argument, a, x->base.value) {
+                if_a (Argument, a, get_obj(x->base.value)) {
                     asserts(!a->var->dims.empty() && a->var->dims[0] == -1);
                     f.has_param_loads = true;
                 }
@@ -64,6 +108,23 @@ void cg(Prog *p) {
             }
     }
 
+    // Mod/ref sets grow along calls until fixed
+    wl.clear();
+    for (auto &f: p->funcs)
+        wl.push_back(&f);
+    while (!wl.empty()) {
+        auto *u = wl.back();
+        wl.pop_back();
+        for (auto *v: u->callers) {
+            bool changed = false;
+            for (auto *c: calls[v - p->funcs.data()])
+                if (c->func == u)
+                    changed = add_call(v, c) || changed;
+            if (changed)
+                wl.push_back(v);
+        }
+    }
+
     for (auto &f: p->funcs) {
         f.is_pure = !(f.has_side_effects || f.has_global_loads || f.has_param_loads);
         if (f.is_pure)
@@ -1,4 +1,5 @@
 #include "ir_common.hpp"
+#include <algorithm>
 #include <unordered_set>
 
 static void traverse(BB *u) {
@@ -31,6 +32,21 @@ static Value *simplify_bin(BinaryInst *x) {
     return nullptr;
 }
 
+// Drops the incoming val from u in phis of v
+static void drop_phi_vals(BB *v, BB *u) {
+    FOR_INST (i, *v) {
+        if_a (PhiInst, x, i) {
+            for (auto it = x->vals.begin(); it != x->vals.end(); ++it) {
+                if (it->second == u) {
+                    x->vals.erase(it);
+                    break;
+                }
+            }
+        } else
+            break;
+    }
+}
+
 void drop_bb(BB *u, Func *f) {
     FOR_LIST_MUT (i, u->insts) {
         u->erase_with(i, nullptr);
@@ -38,6 +54,7 @@ void drop_bb(BB *u, Func *f) {
     }
     f->bbs.erase(u);
     delete u;
+    invalidate(f);
 }
 
 // This ensures BB::get_succ works properly and all bbs are reachable
@@ -50,6 +67,7 @@ bool dbe(Func *f) {
             if (end) {
                 bb->erase(i);
                 delete i;
+                invalidate(f);  // the control inst is changed
                 res = true;
             } else if (i->is_control())
                 end = true;
@@ -72,9 +90,12 @@ bool dbe(Func *f) {
             if_a (Const, c, i->cond.value) {
                 infof("replace br with const cond", c->val);
                 auto *j = new JumpInst{c->val ? i->bb_then : i->bb_else};
+                if (i->bb_then != i->bb_else)
+                    drop_phi_vals(c->val ? i->bb_else : i->bb_then, bb);
                 j->bb = bb;
                 bb->insts.replace(i, j);
                 delete i;
+                invalidate(f);
                 res = true;
             }
         }
@@ -89,25 +110,57 @@ bool dbe(Func *f) {
         if (!u->vis) {
             infof("unreachable bb", u->id);
             // bb can be referred in some PhiInst!
-            for (auto *v: u->get_succ()) if (!deleted.count(v)) {
-                FOR_INST (i, *v) {
+            for (auto *v: u->get_succ())
+                if (!deleted.count(v))
+                    drop_phi_vals(v, u);
+
+            deleted.insert(u);
+            drop_bb(u, f);
+            res = true;
+        }
+    }
+    // Merge v into u, when u jumps to v as its only pred
+    require(f, ana::Pred);
+    bool merged = false;
+    FOR_BB (u, *f) {
+        while (auto *j = as_a<JumpInst>(u->get_control())) {
+            auto *v = j->bb_to;
+            if (v == u || v == f->bbs.front || v->pred.size() != 1)
+                break;
+            infof(f->name, ": merging bb", v->id, "into", u->id);
+            FOR_LIST_MUT (i, v->insts) {
+                if_a (PhiInst, x, i) {
+                    asserts(x->vals.size() == 1);
+                    v->erase_with(x, x->vals.front().first.value);
+                    delete x;
+                } else
+                    break;
+            }
+            u->erase(j);
+            delete j;
+            FOR_LIST_MUT (i, v->insts) {
+                v->erase(i);
+                u->push(i);
+            }
+            for (auto *w: u->get_succ()) {
+                std::replace(w->pred.begin(), w->pred.end(), v, u);
+                FOR_INST (i, *w) {
                     if_a (PhiInst, x, i) {
-                        for (auto it = x->vals.begin(); it != x->vals.end(); ++it) {
-                            if (it->second == u) {
-                                x->vals.erase(it);
-                                break;
-                            }
-                        }
+                        for (auto &p: x->vals)
+                            if (p.second == v)
+                                p.second = u;
                     } else
                         break;
                 }
             }
-
-            deleted.insert(u);
-            drop_bb(u, f);
-            res = true;
+            f->bbs.erase(v);
+            delete v;
+            merged = res = true;
         }
     }
+    if (merged)
+        invalidate(f);
+
     // TODO: trivial phi induce
 
     infof(f->name, ": dbe done");
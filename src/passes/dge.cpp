@@ -67,7 +67,7 @@ void build_once(Prog *p) {
         FOR_BB (bb, f)
             bb->is_once = false;
 
-        build_pred(&f);
+        require(&f, ana::Pred);
         auto *ent = f.bbs.front;
         ent->is_once = ent->pred.empty();
         if (!ent->is_once)
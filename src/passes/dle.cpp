@@ -1,5 +1,6 @@
 #include "ir_common.hpp"
 #include <unordered_set>
+#include <algorithm>
 
 bool res;
 Func *func;
@@ -33,17 +34,23 @@ bool try_elim(Loop *l) {
     if (!exit)
         return false;
 
+    // pre_header may branch to exit already, and then both edges must agree
+    auto succ = pre_header->get_succ();
+    bool guarded = std::find(succ.begin(), succ.end(), exit) != succ.end();
     FOR_INST (i, *exit) {
         if_a (PhiInst, x, i) {
-            Value *v = nullptr;
+            Value *v = nullptr, *w = nullptr;
             for (const auto &p: x->vals)
                 if (loop_bbs.count(p.second)) {
                     if (!v)
                         v = p.first.value;
                     else if (v != p.first.value)
                         return false;
-                }
+                } else if (p.second == pre_header)
+                    w = p.first.value;
             asserts(v);
+            if (guarded && v != w)
+                return false;
         } else
             break;
     }
@@ -70,7 +77,8 @@ bool try_elim(Loop *l) {
                 v = p.first.value;
                 return true;
             });
-            x->push(v, pre_header);
+            if (!guarded)
+                x->push(v, pre_header);
         } else
             break;
     }
@@ -94,7 +102,7 @@ void dfs(Loop *l) {
 }
 
 bool do_dle(Func *f) {
-    build_loop(f);
+    require(f, ana::Loops);
     res = false;
     for (Loop *l: f->loop_roots)
         dfs(l);
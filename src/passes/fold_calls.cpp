@@ -0,0 +1,50 @@
+#include "interp.hpp"
+#include <algorithm>
+
+// Calls to pure functions on const args are replaced by their results, as run
+// by the interpreter. Each run is bounded, and so are all runs in the pass.
+
+namespace {
+
+constexpr uint FUEL = 1 << 20;  // of a call
+constexpr uint TOTAL_FUEL = 1 << 24;
+
+}
+
+bool fold_calls(Prog *prog) {
+    Interp in{prog, 0};
+    std::map<std::pair<Func *, vector<int>>, std::pair<bool, int>> done;
+    uint budget = TOTAL_FUEL;
+    bool changed = false;
+    for (auto &f: prog->funcs) if (!f.is_unused)
+        FOR_BB (bb, f)
+            FOR_LIST_MUT (i, bb->insts) {
+                auto *c = as_a<CallInst>(i);
+                if (!c || !c->func->is_pure || !c->func->returns_int)
+                    continue;
+                vector<int> args;
+                for (auto &u: c->args)
+                    if_a (Const, x, u.value)
+                        args.push_back(x->val);
+                if (args.size() != c->args.size())
+                    continue;
+
+                auto it = done.find({c->func, args});
+                if (it == done.end()) {
+                    int res;
+                    in.fuel = std::min(budget, FUEL);
+                    uint fuel = in.fuel;
+                    bool ok = in.call(c->func, args, res) == Interp::Done;
+                    budget -= fuel - in.fuel;
+                    it = done.insert({{c->func, args}, {ok, res}}).first;
+                }
+                if (!it->second.first)
+                    continue;
+                infof(f.name, ": folding call to", c->func->name, "into", it->second.second);
+                c->replace_uses(Const::of(it->second.second));
+                bb->erase(c);
+                delete c;
+                changed = true;
+            }
+    return changed;
+}
@@ -1,4 +1,7 @@
 #include "ir_common.hpp"
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
 
 static Value *reduced_bin(BinaryInst *x) {
     if_a (Const, lc, x->lhs.value) {
@@ -44,6 +47,34 @@ static Value *reduced_bin(BinaryInst *x) {
     return nullptr;
 }
 
+// Loads which no store or call in the func may change, and which are safe
+// to speculate, so they are numbered and moved freely like pure insts
+static std::unordered_set<Inst *> free_loads;
+
+static void find_free_loads(Func *f) {
+    free_loads.clear();
+    vector<MemLoc> stores;
+    vector<CallInst *> calls;
+    vector<std::pair<LoadInst *, MemLoc>> loads;
+    FOR_BB_INST (i, bb, *f) {
+        if_a (StoreInst, x, i)
+            stores.push_back(get_loc(x));
+        else if_a (CallInst, x, i)
+            calls.push_back(x);
+        else if_a (LoadInst, x, i) {
+            auto l = get_loc(x);
+            if (is_safe_to_speculate(l))
+                loads.emplace_back(x, l);
+        }
+    }
+    for (auto &p: loads) {
+        auto &l = p.second;
+        if (std::none_of(stores.begin(), stores.end(), [&](const MemLoc &s) { return may_alias(l, s); }) &&
+            std::none_of(calls.begin(), calls.end(), [&](CallInst *c) { return get_mod_ref(c, l) & mr::Mod; }))
+            free_loads.insert(p.first);
+    }
+}
+
 static void build_po(BB *u, vector<BB *> &res) {
     if (u->vis)
         return;
@@ -53,71 +84,174 @@ static void build_po(BB *u, vector<BB *> &res) {
     res.push_back(u);
 }
 
+// Operands of x op y can be swapped if op has a mirror
+static bool get_mirror(OpKind op, OpKind &res) {
+    for (auto o: {op, tkd::Lt, tkd::Gt, tkd::Le, tkd::Ge})
+        if (BinaryInst::is_op_mirror(op, o)) {
+            res = o;
+            return true;
+        }
+    return false;
+}
+
 struct GVN {
-    vector<std::pair<Value *, Value *>> vn;
+    // (callee, [op, operand numbers...]) for CallInst, BinaryInst and GEPInst
+    using Expr = std::pair<const Func *, vector<uint>>;
+
+    struct ExprHash {
+        size_t operator () (const Expr &e) const {
+            size_t h = std::hash<const Func *>()(e.first);
+            for (uint x: e.second)
+                h = h * 1000003 ^ x;
+            return h;
+        }
+    };
+
+    static constexpr const uint GEP_OP = uint(-1), LOAD_OP = uint(-2);
+
+    std::unordered_map<Value *, uint> vn;
+    vector<Value *> leader;  // of each value number
+    std::unordered_map<Expr, uint, ExprHash> exprs;
 
-    template<class T>
-    Value *find_a(T *) {
-        unreachable();
+    uint new_number(Value *v) {
+        leader.push_back(v);
+        return leader.size() - 1;
     }
 
-    struct LazyValue {
-        Value *const v, *res = nullptr;
-        GVN *const ctx;
+    uint hash_cons(Expr &&e, Value *v) {
+        auto it = exprs.find(e);
+        if (it != exprs.end())
+            return it->second;
+        uint n = new_number(v);
+        exprs.emplace(std::move(e), n);
+        return n;
+    }
 
-        LazyValue(Value *v, GVN *ctx) : v(v), ctx(ctx) {}
+    uint number(Value *i);
 
-        operator Value * () {
-            if (!res)
-                res = ctx->get(v);
-            return res;
-        }
-    };
+    // Memory versions, where loads are keyed by the versions they read under.
+    // Stores and calls bump the decls they may write to, along with what may
+    // alias them, and merges bump all. Versions are never reused.
+    std::unordered_map<Expr, Value *, ExprHash> loads;
+    std::unordered_map<const Decl *, uint> mem_decl;
+    uint mem_all = 0, mem_param = 0, mem_array = 0, mem_cnt = 0;
+    vector<std::pair<uint *, uint>> mem_log;
+    vector<Expr> load_log;
+
+    static bool is_param(const Decl *d) {
+        return !d->dims.empty() && d->dims.front() < 0;
+    }
+
+    void bump(uint &ver) {
+        mem_log.emplace_back(&ver, ver);
+        ver = ++mem_cnt;
+    }
+
+    // Params may point to any array but never to a scalar
+    Expr load_key(MemInst *x) {
+        auto *d = x->lhs;
+        uint cls = is_param(d) ? mem_array : d->dims.empty() ? 0 : mem_param;
+        return {nullptr, {number(x->base.value), number(x->off.value), mem_all, mem_decl[d], cls}};
+    }
+
+    void clobber(const Decl *d) {
+        bump(mem_decl[d]);
+        if (is_param(d)) {
+            bump(mem_param);
+            bump(mem_array);
+        } else if (!d->dims.empty())
+            bump(mem_array);
+    }
+
+    void store(StoreInst *x) {
+        clobber(x->lhs);
+        auto k = load_key(x);
+        load_log.push_back(k);
+        loads.emplace(std::move(k), x->val.value);
+    }
 
-    LazyValue lazy_get(Value *v) {
-        return {v, this};
+    void call(CallInst *x) {
+        auto *f = x->func;
+        for (auto *d: f->mod_globals)
+            clobber(d);
+        for (uint k = 0; k < f->mod_params.size(); ++k) {
+            if (!f->mod_params[k])
+                continue;
+            auto *obj = get_obj(x->args[k].value);
+            if_a (Global, o, obj)
+                clobber(o->var);
+            else if_a (AllocaInst, o, obj)
+                clobber(o->var);
+            else if_a (Argument, o, obj)
+                clobber(o->var);
+            else
+                bump(mem_all);
+        }
     }
 
-    template <class T>
-    Value *get_a(T *i) {
-        for (auto &p: vn) if (p.first == i)
-            return p.second;
-        auto *v = find_a<T>(i);
-        vn.emplace_back(i, v);
-        return v;
+    // Dominated loads of the same version are replaced, scoped by the dom tree
+    void rle(BB *bb) {
+        auto mem_top = mem_log.size(), load_top = load_log.size();
+        if (bb->pred.size() != 1)
+            bump(mem_all);
+        FOR_LIST_MUT (i, bb->insts) {
+            if_a (LoadInst, x, i) {
+                auto k = load_key(x);
+                auto it = loads.find(k);
+                if (it != loads.end()) {
+                    infof(bb->func->name, ": load of", x->lhs->name, "is redundant");
+                    replace(x, it->second);
+                } else {
+                    load_log.push_back(k);
+                    loads.emplace(std::move(k), x);
+                }
+            } else if_a (StoreInst, x, i)
+                store(x);
+            else if_a (CallInst, x, i)
+                call(x);
+        }
+        for (auto *v: bb->dom_chs)
+            rle(v);
+
+        while (load_log.size() > load_top) {
+            loads.erase(load_log.back());
+            load_log.pop_back();
+        }
+        while (mem_log.size() > mem_top) {
+            *mem_log.back().first = mem_log.back().second;
+            mem_log.pop_back();
+        }
     }
 
-    Value *get(Value *i);
+    Value *get(Value *i) {
+        return leader[number(i)];
+    }
 
     void replace(Inst *i, Value *v) {
         if (i != v) {
-            i->bb->erase_with(i, v);
-            for (auto &p: vn) if (p.first == i) { // TODO
-                std::swap(p, vn.back());
-                vn.pop_back();
-                break;
+            auto it = vn.find(i);
+            if (it != vn.end()) {
+                if (leader[it->second] == i)
+                    leader[it->second] = v;
+                vn.erase(it);
             }
+            i->bb->erase_with(i, v);
             delete i;
         }
     }
 
-    template <class T>
-    void replace(T *i) {
-        replace(i, get_a(i));
-    }
-
     void check(Inst *i) {
         if_a (BinaryInst, x, i) {
             auto *v = reduced_bin(x);
             if (v)
                 replace(i, get(v));  // TODO: no get
             else
-                replace(x);
+                replace(x, get(x));
         } else if_a (CallInst, x, i) {
             if (x->func->is_pure)
-                replace(x);
-        } else if_a (GEPInst, x, i)
-            replace(x);
+                replace(x, get(x));
+        } else if (is_a<GEPInst>(i) || free_loads.count(i))
+            replace(i, get(i));
         else if_a (PhiInst, x, i) { // TODO: undef
             auto &vals = x->vals;
             asserts(!vals.empty());
@@ -137,6 +271,7 @@ struct GVN {
     }
 
     void gvn(Func *f) {
+        rle(f->bbs.front);
         FOR_BB (bb, *f)
             bb->vis = false;
         vector<BB *> po;
@@ -147,79 +282,46 @@ struct GVN {
     }
 };
 
-template <>
-Value *GVN::find_a(BinaryInst *k) {
-    auto op = k->op;
-    auto lh = get(k->lhs.value), rh = get(k->rhs.value); // FIXME: lazy_get causes infinite recursion
-    for (uint i = 0; i < vn.size(); ++i) {
-        auto p = vn[i];
-        if_a (BinaryInst, x, p.first) {
-            auto o = x->op;
-            auto *l = get(x->lhs.value), *r = get(x->rhs.value);
-            if ((lh == l && rh == r && op == o) ||
-                (lh == r && rh == l && BinaryInst::is_op_mirror(op, o))
-                )
-                return p.second;  // ref could have been invalid
-        }
-    }
-    return k;
-}
-
-template <>
-Value *GVN::find_a(CallInst *k) {
-    auto *f = k->func;
-    if (!f->is_pure)
-        return k;
-    vector<Value *> args;
-    for (auto &u: k->args)
-        args.push_back(get(u.value));
-    for (uint i = 0; i < vn.size(); ++i) {
-        auto p = vn[i];
-        if_a (CallInst, x, p.first) if (x->func == f) {
-            bool ok = true;
-            uint n = args.size();
-            for (uint j = 0; j < n; ++j) {
-                if (args[j] != get(x->args[j].value)) {
-                    ok = false;
-                    break;
-                }
-            }
-            if (ok)
-                return p.second;
-        }
-    }
-    return k;
-}
-
-template <>
-Value *GVN::find_a(GEPInst *k) {
-    auto base = get(k->base.value), off = get(k->off.value);
-    for (uint i = 0; i < vn.size(); ++i) {
-        auto p = vn[i];
-        if_a (GEPInst, x, p.first) {
-            if (get(x->base.value) == base && get(x->off.value) == off)
-                return p.second;
-        }
-    }
-    return k;
-}
-
-Value *GVN::get(Value *i) {
-    for (auto &p: vn) if (p.first == i)
-        return p.second;
-    Value *v;
-    if_a (BinaryInst, x, i) v = find_a(x);
-    else if_a (CallInst, x, i) v = find_a(x);
-    else if_a (GEPInst, x, i) v = find_a(x);
-    else v = i;
-    vn.emplace_back(i, v);
-    return v;
+// Operands are numbered before i, which terminates as phis are not looked into
+uint GVN::number(Value *i) {
+    auto it = vn.find(i);
+    if (it != vn.end())
+        return it->second;
+    uint n;
+    if_a (BinaryInst, x, i) {
+        auto op = x->op;
+        uint lh = number(x->lhs.value), rh = number(x->rhs.value);
+        if (lh > rh && get_mirror(op, op))
+            std::swap(lh, rh);
+        n = hash_cons({nullptr, {uint(op), lh, rh}}, x);
+    } else if_a (CallInst, x, i) {
+        if (x->func->is_pure) {
+            vector<uint> args;
+            for (auto &u: x->args)
+                args.push_back(number(u.value));
+            n = hash_cons({x->func, std::move(args)}, x);
+        } else
+            n = new_number(x);
+    } else if_a (GEPInst, x, i) {
+        uint base = number(x->base.value), off = number(x->off.value);
+        n = hash_cons({nullptr, {GEP_OP, base, off}}, x);
+    } else if_a (LoadInst, x, i) {
+        if (free_loads.count(x)) {
+            uint base = number(x->base.value), off = number(x->off.value);
+            n = hash_cons({nullptr, {LOAD_OP, base, off}}, x);
+        } else
+            n = new_number(x);
+    } else
+        n = new_number(i);
+    vn[i] = n;
+    return n;
 }
 
 static bool is_pinned(Inst *i) {
     if_a (CallInst, x, i)
         return !x->func->is_pure;  // Will infinite loops be promoted?
-    return i->has_side_effects() || is_a<PhiInst>(i) || is_a<LoadInst>(i) || is_a<AllocaInst>(i);
+    return i->has_side_effects() || is_a<PhiInst>(i) || is_a<AllocaInst>(i) ||
+        (is_a<LoadInst>(i) && !free_loads.count(i));
 }
 
 static void schedule_early(Inst *i, BB *root) {
@@ -307,7 +409,9 @@ static void schedule_late(Inst *i) {
 void gg(Func *f) {
     infof(f->name, "gg");
 
-    build_loop(f);
+    add_pre_headers(f);
+    require(f, ana::Loops);
+    find_free_loads(f);
     GVN().gvn(f);
     dce(f);
 
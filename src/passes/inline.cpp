@@ -0,0 +1,287 @@
+#include "ir_common.hpp"
+#include <unordered_map>
+
+// Inlines calls by a size and loop depth cost model, before mem2reg.
+// Calls within a recursive SCC are inlined for one level only.
+
+constexpr uint MAX_CALLER_SIZE = 2000;
+constexpr int MAX_ROUNDS = 3;
+
+static uint get_size(Func *f) {
+    uint n = 0;
+    FOR_BB_INST (i, bb, *f)
+        ++n;
+    return n;
+}
+
+static bool has_arrays(Func *f) {
+    FOR_BB_INST (i, bb, *f)
+        if_a (AllocaInst, x, i)
+            if (!x->var->dims.empty())
+                return true;
+    return false;
+}
+
+static bool is_worth(bool has_arrays, uint size, int depth, uint n_calls, bool recursive) {
+    if (has_arrays && n_calls != 1)
+        return false;  // which grow the frame and get initialized per call
+    if (recursive)
+        return size <= 24;
+    if (n_calls == 1)
+        return size <= 400;  // the callee is dropped then
+    return size <= 16u + 32u * uint(std::min(depth, 2));
+}
+
+// The object an array param points to, for cg to tell loads and stores through it
+static Decl *get_decl(Value *v) {
+    if_a (Global, x, v)
+        return const_cast<Decl *>(x->var);
+    if_a (AllocaInst, x, v)
+        return x->var;
+    if_a (Argument, x, v)
+        return x->var;
+    if_a (GEPInst, x, v)
+        return x->lhs;
+    unreachable();
+}
+
+struct Inliner {
+    Func *f, *g;
+    CallInst *call;
+    std::unordered_map<Value *, Value *> vals;
+    std::unordered_map<Decl *, Decl *> decls;
+    vector<BB *> bbs;  // by id in g
+    vector<std::pair<PhiInst *, PhiInst *>> phis;
+    vector<std::pair<Value *, BB *>> rets;
+    BB *bb_cont;
+
+    Value *get(Value *v) {
+        if_a (Argument, x, v)
+            return call->args[x->pos].value;
+        if (is_a<Inst>(v)) {
+            auto it = vals.find(v);
+            asserts(it != vals.end());
+            return it->second;
+        }
+        return v;
+    }
+
+    Decl *get(Decl *d) {
+        auto it = decls.find(d);
+        return it == decls.end() ? d : it->second;
+    }
+
+    Inst *clone(Inst *i, BB *bb) {
+        if_a (BinaryInst, x, i)
+            return new BinaryInst{x->op, get(x->lhs.value), get(x->rhs.value)};
+        if_a (CallInst, x, i) {
+            vector<Value *> argv;
+            argv.reserve(x->args.size());
+            for (auto &u: x->args)
+                argv.push_back(get(u.value));
+            return new CallInst{x->func, argv};
+        }
+        if_a (BranchInst, x, i)
+            return new BranchInst{get(x->cond.value), bbs[x->bb_then->id], bbs[x->bb_else->id]};
+        if_a (JumpInst, x, i)
+            return new JumpInst{bbs[x->bb_to->id]};
+        if_a (ReturnInst, x, i) {
+            rets.emplace_back(x->val.value ? get(x->val.value) : &Undef::VAL, bb);
+            return new JumpInst{bb_cont};
+        }
+        if_a (LoadInst, x, i)
+            return new LoadInst{get(x->lhs), get(x->base.value), get(x->off.value)};
+        if_a (StoreInst, x, i)
+            return new StoreInst{get(x->lhs), get(x->base.value), get(x->off.value), get(x->val.value)};
+        if_a (GEPInst, x, i)
+            return new GEPInst{get(x->lhs), get(x->base.value), get(x->off.value), x->size};
+        if_a (PhiInst, x, i) {
+            auto *y = new PhiInst;
+            phis.emplace_back(x, y);
+            return y;
+        }
+        unreachable();
+    }
+
+    // Defs dominate their uses except in phis, which are filled at last
+    void clone_dom(BB *u) {
+        auto *bb = bbs[u->id];
+        FOR_INST (i, *u) {
+            if_a (AllocaInst, x, i)  // kept in the entry, out of any loop
+                vals[i] = f->bbs.front->push_front(new AllocaInst{x->var});
+            else
+                vals[i] = bb->push(clone(i, bb));
+        }
+        for (auto *v: u->dom_chs)
+            clone_dom(v);
+    }
+
+    void run(Func *caller, CallInst *c) {
+        f = caller;
+        call = c;
+        g = c->func;
+        infof("inlining", g->name, "into", f->name);
+        vals.clear();
+        decls.clear();
+        phis.clear();
+        rets.clear();
+
+        for (uint i = 0; i < g->params.size(); ++i) {
+            auto *d = g->params[i];
+            if (!d->dims.empty())
+                decls[d] = get_decl(c->args[i].value);
+        }
+
+        // Clone before splitting, as g may be f itself
+        require(g, ana::Dom);
+        BB *bb = c->bb, *after = bb;
+        bb_cont = f->new_bb_after(bb);
+        bbs.assign(g->bb_cnt, nullptr);
+        vector<BB *> reachable;
+        FOR_BB (u, *g)
+            if (u->dom_in <= u->dom_out && u != bb_cont)
+                reachable.push_back(u);
+        for (auto *u: reachable)
+            bbs[u->id] = after = f->new_bb_after(after);
+        clone_dom(g->bbs.front);
+        for (auto &p: phis)
+            for (auto &v: p.first->vals)
+                if (auto *u = bbs[v.second->id])
+                    p.second->push(get(v.first.value), u);
+
+        for (Inst *i = c->next, *next; i; i = next) {
+            next = i->next;
+            bb->insts.erase(i);
+            bb_cont->push(i);
+        }
+        for (auto *v: bb_cont->get_succ())
+            FOR_INST (i, *v) {
+                if_a (PhiInst, x, i) {
+                    for (auto &p: x->vals)
+                        if (p.second == bb)
+                            p.second = bb_cont;
+                } else
+                    break;
+            }
+
+        if (!c->uses.empty()) {
+            Value *r = &Undef::VAL;
+            if (rets.size() == 1)
+                r = rets.front().first;
+            else if (rets.size() > 1) {
+                auto *phi = bb_cont->push_front(new PhiInst);
+                for (auto &p: rets)
+                    phi->push(p.first, p.second);
+                r = phi;
+            }
+            c->replace_uses(r);
+        }
+        bb->erase(c);
+        delete c;
+        bb->push(new JumpInst{bbs[g->bbs.front->id]});
+        invalidate(f);
+    }
+};
+
+// Tarjan, where SCCs are listed with callees first
+struct CallGraph {
+    Prog *p;
+    vector<vector<uint>> succ;
+    vector<uint> dfn, low, scc, stack, order;
+    vector<bool> on_stack;
+    uint clock = 0, scc_cnt = 0;
+
+    bool has(Func *g) const {
+        return g >= p->funcs.data() && g < p->funcs.data() + p->funcs.size();
+    }
+
+    uint id(Func *g) const {
+        return uint(g - p->funcs.data());
+    }
+
+    void dfs(uint u) {
+        dfn[u] = low[u] = ++clock;
+        stack.push_back(u);
+        on_stack[u] = true;
+        for (uint v: succ[u]) {
+            if (!dfn[v]) {
+                dfs(v);
+                low[u] = std::min(low[u], low[v]);
+            } else if (on_stack[v])
+                low[u] = std::min(low[u], dfn[v]);
+        }
+        if (low[u] == dfn[u]) {
+            uint v;
+            do {
+                v = stack.back();
+                stack.pop_back();
+                on_stack[v] = false;
+                scc[v] = scc_cnt;
+                order.push_back(v);
+            } while (v != u);
+            ++scc_cnt;
+        }
+    }
+
+    // Over Func::callers, which cg has built
+    explicit CallGraph(Prog *p) : p(p) {
+        uint n = p->funcs.size();
+        succ.resize(n);
+        for (uint v = 0; v < n; ++v)
+            for (auto *u: p->funcs[v].callers)
+                succ[id(u)].push_back(v);
+        dfn.assign(n, 0);
+        low.assign(n, 0);
+        scc.assign(n, 0);
+        on_stack.assign(n, false);
+        for (uint u = 0; u < n; ++u)
+            if (!dfn[u])
+                dfs(u);
+    }
+};
+
+void inl(Prog *p) {
+    Inliner inliner;
+    for (int round = 0; round < MAX_ROUNDS; ++round) {
+        if (round)
+            cg(p);
+        CallGraph graph{p};
+        vector<uint> n_calls(p->funcs.size());
+        for (auto &f: p->funcs)
+            FOR_BB_INST (i, bb, f)
+                if_a (CallInst, x, i)
+                    if (graph.has(x->func))
+                        ++n_calls[graph.id(x->func)];
+
+        bool changed = false;
+        for (uint u: graph.order) {
+            auto *f = &p->funcs[u];
+            uint size = get_size(f);
+            if (size >= MAX_CALLER_SIZE)
+                continue;
+            require(f, ana::Loops);
+            vector<std::pair<CallInst *, int>> sites;
+            FOR_BB_INST (i, bb, *f)
+                if_a (CallInst, x, i)
+                    if (graph.has(x->func) && x->func->name != "main")
+                        sites.emplace_back(x, bb->loop ? bb->loop->depth : 0);
+
+            for (auto &s: sites) {
+                auto *g = s.first->func;
+                uint v = graph.id(g);
+                bool recursive = graph.scc[u] == graph.scc[v];
+                if (recursive && round)
+                    continue;
+                uint g_size = get_size(g);
+                if (!is_worth(has_arrays(g), g_size, s.second, n_calls[v], recursive) || size + g_size > MAX_CALLER_SIZE)
+                    continue;
+                inliner.run(f, s.first);
+                size += g_size;
+                --n_calls[v];
+                changed = true;
+            }
+        }
+        if (!changed)
+            break;
+    }
+}
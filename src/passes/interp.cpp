@@ -0,0 +1,232 @@
+#include "interp.hpp"
+
+namespace {
+
+constexpr uint MAX_DEPTH = 1 << 16;
+constexpr uint MAX_WORDS = 1 << 24;  // of frames and their allocas
+constexpr uint MAX_OUT = 1 << 16;
+
+bool is_arith(OpKind op) {
+    return op == tkd::Add || op == tkd::Sub || op == tkd::Mul || op == tkd::Div || op == tkd::Mod;
+}
+
+}
+
+Interp::Interp(Prog *prog, uint fuel) : fuel(fuel) {
+    for (auto *d: prog->globals) {
+        globals[d] = mem.size();
+        mem.emplace_back(d->size());
+        if (d->has_init && d->init.size() == d->size())
+            for (uint k = 0; k < d->init.size(); ++k)
+                if_a (ast::Number, x, d->init[k])
+                    mem.back()[k] = x->val;
+    }
+    for (auto &f: prog->funcs) {
+        uint n = 0;
+        FOR_BB_INST (i, bb, f)
+            i->id = n++;
+        sizes[&f] = n;
+    }
+}
+
+Interp::Val Interp::get(Value *v) {
+    if_a (Const, x, v)
+        return {x->val, -1};
+    if_a (Inst, x, v)
+        return stack.back().vals[x->id];
+    if_a (Argument, x, v)
+        return stack.back().args[x->pos];
+    if_a (Global, x, v) {
+        auto it = globals.find(x->var);
+        return {0, it == globals.end() ? -2 : it->second};  // dropped by pe
+    }
+    return {0, -1};
+}
+
+// Phis take their vals at once, as they may use each other
+void Interp::enter(BB *to, BB *from) {
+    auto &fr = stack.back();
+    phi_vals.clear();
+    Inst *i = to->insts.front;
+    for (; is_a<PhiInst>(i); i = i->next)
+        for (auto &p: static_cast<PhiInst *>(i)->vals)
+            if (p.second == from) {
+                phi_vals.emplace_back(i->id, get(p.first.value));
+                break;
+            }
+    for (auto &p: phi_vals)
+        fr.vals[p.first] = p.second;
+    fr.pc = i;
+}
+
+bool Interp::push(Func *f, vector<Val> &&args) {
+    auto it = sizes.find(f);
+    if (it == sizes.end() || stack.size() >= MAX_DEPTH || (words += it->second) > MAX_WORDS)
+        return false;
+    stack.push_back({f, vector<Val>(it->second, Val{0, -2}), std::move(args), nullptr, uint(mem.size())});
+    enter(f->bbs.front, nullptr);
+    return true;
+}
+
+void Interp::pop() {
+    auto &fr = stack.back();
+    words -= fr.vals.size();
+    for (uint k = fr.objs; k < mem.size(); ++k)
+        words -= mem[k].size();
+    mem.resize(fr.objs);
+    stack.pop_back();
+}
+
+int *Interp::at(const Val &p, int off) {
+    uint a = uint(p.i) + uint(off);
+    if (p.obj < 0 || a % 4 || a / 4 >= mem[p.obj].size())
+        return nullptr;
+    return &mem[p.obj][a / 4];
+}
+
+void Interp::print(PrintfFunc *f, CallInst *c) {
+    const char *p = f->fmt + 1, *end = f->fmt + f->len - 1;  // within the quotes
+    uint k = 0;
+    for (; p < end; ++p)
+        if (*p == '%') {
+            out += std::to_string(get(c->args[k++].value).i);
+            ++p;
+        } else if (*p == '\\') {
+            out += '\n';
+            ++p;
+        } else
+            out += *p;
+}
+
+Interp::Status Interp::run(Val &res) {
+    while (true) {
+        if (!fuel)
+            return OutOfFuel;
+        --fuel;
+        auto &fr = stack.back();
+        auto *i = fr.pc;
+        Val v{0, -1};
+        switch (i->kind) {
+            case vk::Binary: {
+                auto *x = static_cast<BinaryInst *>(i);
+                auto l = get(x->lhs.value), r = get(x->rhs.value);
+                if (l.obj != r.obj || (l.obj >= 0 && is_arith(x->op)))
+                    return Fault;  // pointers are only compared within an object
+                if (x->op == tkd::Add)
+                    v.i = int(uint(l.i) + uint(r.i));
+                else if (x->op == tkd::Sub)
+                    v.i = int(uint(l.i) - uint(r.i));
+                else if (x->op == tkd::Mul)
+                    v.i = int(uint(l.i) * uint(r.i));
+                else if ((x->op == tkd::Div || x->op == tkd::Mod) && (!r.i || (l.i == Const::MIN && r.i == -1)))
+                    return Fault;
+                else
+                    v.i = eval_bin(x->op, l.i, r.i);
+                break;
+            }
+            case vk::Call: {
+                auto *x = static_cast<CallInst *>(i);
+                if (is_a<GetIntFunc>(x->func))
+                    return Input;
+                if_a (PrintfFunc, f, x->func) {
+                    print(f, x);
+                    if (out.size() > MAX_OUT)
+                        return Fault;
+                    break;
+                }
+                vector<Val> args;
+                args.reserve(x->args.size());
+                for (auto &u: x->args)
+                    args.push_back(get(u.value));
+                if (!push(x->func, std::move(args)))
+                    return Fault;
+                continue;
+            }
+            case vk::Return: {
+                auto *x = static_cast<ReturnInst *>(i);
+                if (x->val.value)
+                    v = get(x->val.value);
+                pop();
+                if (stack.empty()) {
+                    res = v;
+                    return Done;
+                }
+                auto &c = stack.back();
+                c.vals[c.pc->id] = v;
+                c.pc = c.pc->next;
+                continue;
+            }
+            case vk::Branch: {
+                auto *x = static_cast<BranchInst *>(i);
+                enter(get(x->cond.value).i ? x->bb_then : x->bb_else, i->bb);
+                continue;
+            }
+            case vk::BinaryBranch: {
+                auto *x = static_cast<BinaryBranchInst *>(i);
+                auto l = get(x->lhs.value), r = get(x->rhs.value);
+                if (l.obj != r.obj)
+                    return Fault;
+                enter(rel::eval(x->op, l.i, r.i) ? x->bb_then : x->bb_else, i->bb);
+                continue;
+            }
+            case vk::Jump:
+                enter(static_cast<JumpInst *>(i)->bb_to, i->bb);
+                continue;
+            case vk::Load: {
+                auto *x = static_cast<LoadInst *>(i);
+                auto *p = at(get(x->base.value), get(x->off.value).i);
+                if (!p)
+                    return Fault;
+                v.i = *p;
+                break;
+            }
+            case vk::Store: {
+                auto *x = static_cast<StoreInst *>(i);
+                auto *p = at(get(x->base.value), get(x->off.value).i);
+                auto val = get(x->val.value);
+                if (!p || val.obj >= 0)
+                    return Fault;
+                *p = val.i;
+                break;
+            }
+            case vk::GEP: {
+                auto *x = static_cast<GEPInst *>(i);
+                v = get(x->base.value);
+                if (v.obj < 0)
+                    return Fault;
+                v.i = int(uint(v.i) + uint(get(x->off.value).i) * uint(x->size));
+                break;
+            }
+            case vk::Alloca: {
+                uint n = static_cast<AllocaInst *>(i)->var->size();
+                if ((words += n) > MAX_WORDS)
+                    return Fault;
+                v.obj = mem.size();
+                mem.emplace_back(n);
+                break;
+            }
+            default:
+                return Fault;
+        }
+        fr.vals[i->id] = v;
+        fr.pc = i->next;
+    }
+}
+
+Interp::Status Interp::call(Func *f, const vector<int> &args, int &res) {
+    vector<Val> argv;
+    for (int x: args)
+        argv.push_back({x, -1});
+    Val r{0, -1};
+    auto s = push(f, std::move(argv)) ? run(r) : Fault;
+    while (!stack.empty())
+        pop();
+    words = 0;
+    res = r.i;
+    return s;
+}
+
+Interp::Status Interp::run_main(Func *main) {
+    Val r{0, -1};
+    return push(main, {}) ? run(r) : Fault;
+}
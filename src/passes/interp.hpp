@@ -0,0 +1,53 @@
+#pragma once
+
+#include "ir_common.hpp"
+#include <map>
+
+// An interpreter of IR, bounded by the insts it may run. Memory is made of
+// objects of words: the globals from their inits, and the allocas of each
+// frame, which die with it. Pointers are offsets in bytes into an object.
+struct Interp {
+    enum Status {
+        Done,
+        Input,  // at a call to getint, which is left to run
+        Fault,  // at anything undefined, or out of the limits of the host
+        OutOfFuel
+    };
+
+    struct Val {
+        int i;
+        int obj;  // -1 for ints, -2 if never set
+    };
+
+    struct Frame {
+        Func *f;
+        vector<Val> vals;  // by inst id
+        vector<Val> args;
+        Inst *pc;
+        uint objs;  // in mem at entry
+    };
+
+    uint fuel;
+    string out;  // by printf
+    vector<vector<int>> mem;
+    std::map<const Decl *, int> globals;
+    vector<Frame> stack;
+
+    Interp(Prog *prog, uint fuel);
+
+    Status call(Func *f, const vector<int> &args, int &res);
+    Status run_main(Func *main);  // leaving the state as it stops
+
+private:
+    std::map<const Func *, uint> sizes;  // of insts
+    uint words = 0;  // taken by frames
+    vector<std::pair<uint, Val>> phi_vals;
+
+    Val get(Value *v);
+    void enter(BB *to, BB *from);
+    bool push(Func *f, vector<Val> &&args);
+    void pop();
+    int *at(const Val &p, int off);
+    void print(PrintfFunc *f, CallInst *c);
+    Status run(Val &res);
+};
@@ -6,68 +6,117 @@ void build_pred(Func *f) {
     FOR_BB (u, *f)
         for (BB *v : u->get_succ())
             v->pred.push_back(u);
+    f->valid |= ana::Pred;
 }
 
-static void traverse(BB *u, BB *block) {
-    if (u->vis || u == block)
+static void build_po(BB *u, vector<BB *> &po) {
+    if (u->vis)
         return;
     u->vis = true;
-    for (auto v : u->get_succ())
-        traverse(v, block);
+    for (auto *v: u->get_succ())
+        build_po(v, po);
+    u->po = po.size();
+    po.push_back(u);
 }
 
+static BB *intersect(BB *u, BB *v) {
+    while (u != v) {
+        while (u->po < v->po)
+            u = u->idom;
+        while (v->po < u->po)
+            v = v->idom;
+    }
+    return u;
+}
+
+static uint dom_clock;
+
+// dom_in and dom_out bound the dfs interval of u in the dom tree
 static void set_depth(BB *u, int depth) {
     u->dom_depth = depth;
+    u->dom_in = dom_clock++;
     for (auto *p: u->dom_chs)
         set_depth(p, depth + 1);
+    u->dom_out = dom_clock++;
 }
 
+// Cooper, Harvey & Kennedy, "A Simple, Fast Dominance Algorithm", iterating over rpo
 void build_dom(Func *f) {
+    require(f, ana::Pred);
     FOR_BB (u, *f) {
-        u->dom.clear();
         u->dom_chs.clear();
         u->idom = nullptr;
+        u->vis = false;
+        u->dom_in = 1;  // empty intervals for unreachable bbs
+        u->dom_out = 0;
     }
 
-    FOR_BB (w, *f) {
-        FOR_BB (u, *f)
-            u->vis = false;
+    vector<BB *> po;
+    auto *entry = f->bbs.front;
+    build_po(entry, po);
 
-        traverse(f->bbs.front, w);
-        FOR_BB (u, *f) if (!u->vis) {
-                u->dom.insert(w);
-                info("%s: bb_%d doms bb_%d", f->name.data(), w->id, u->id);
+    entry->idom = entry;
+    bool changed;
+    do {
+        changed = false;
+        for (auto it = po.rbegin() + 1; it != po.rend(); ++it) {
+            BB *u = *it, *d = nullptr;
+            for (BB *p: u->pred)
+                if (p->idom)  // processed, which also skips unreachable preds
+                    d = d ? intersect(p, d) : p;
+            if (u->idom != d) {
+                u->idom = d;
+                changed = true;
             }
-    }
+        }
+    } while (changed);
+    entry->idom = nullptr;
 
-    FOR_BB (u, *f) {
-        for (BB *w : u->dom) if (u != w) {
-                bool ok = true;
-                for (BB *v : u->dom)
-                    if (v != u && w != v && v->dom.count(w)) {
-                        ok = false;
-                        break;
-                    }
-                if (ok) {
-                    u->idom = w;
-                    w->dom_chs.insert(u);
-                    info("%s: bb_%d idoms bb_%d", f->name.data(), w->id, u->id);
-                    break;
-                }
-            }
+    for (auto it = po.rbegin() + 1; it != po.rend(); ++it) {
+        BB *u = *it;
+        u->idom->dom_chs.push_back(u);
+        info("%s: bb_%d idoms bb_%d", f->name.data(), u->idom->id, u->id);
     }
 
-    set_depth(f->bbs.front, 0);
+    dom_clock = 0;
+    set_depth(entry, 0);
+    f->valid |= ana::Dom;
+}
+
+void require(Func *f, uint kinds) {
+    kinds &= ~f->valid;
+    if (kinds & ana::Pred)
+        build_pred(f);
+    if (kinds & ana::Dom)
+        build_dom(f);
+    if (kinds & ana::DF)
+        build_df(f);
+    if (kinds & ana::Loops)
+        build_loop(f);
+}
+
+// Dom is built over Pred, while DF and Loops are over Dom
+void invalidate(Func *f, uint kinds) {
+    if (kinds & ana::Pred)
+        kinds |= ana::Dom;
+    if (kinds & ana::Dom)
+        kinds |= ana::DF | ana::Loops;
+    f->valid &= ~kinds;
+}
+
+OwnedUses::OwnedUses(std::initializer_list<const Use *> l) : n(l.size()) {
+    std::copy(l.begin(), l.end(), fixed);
 }
 
-vector<const Use *> get_owned_uses(Inst *i) {
+OwnedUses::OwnedUses(const Use *first, uint n, uint stride) :
+    base(reinterpret_cast<const char *>(first)), n(n), stride(stride) {}
+
+OwnedUses get_owned_uses(Inst *i) {
     if_a (BinaryInst, x, i)
         return {&x->lhs, &x->rhs};
     else if_a (CallInst, x, i) {
-        vector<const Use *> res;
-        for (auto &u: x->args)
-            res.push_back(&u);
-        return res;
+        if (!x->args.empty())
+            return {x->args.data(), uint(x->args.size()), sizeof(Use)};
     } else if_a (BranchInst, x, i)
         return {&x->cond};
     else if_a (ReturnInst, x, i) {
@@ -80,10 +129,56 @@ vector<const Use *> get_owned_uses(Inst *i) {
     else if_a (GEPInst, x, i)
         return {&x->base, &x->off};
     else if_a (PhiInst, x, i) {
-        vector<const Use *> res;
-        for (auto &u: x->vals)
-            res.push_back(&u.first);
-        return res;
+        if (!x->vals.empty())
+            return {&x->vals.front().first, uint(x->vals.size()), sizeof(x->vals.front())};
     }
     return {};
 }
+
+void insert_before(Inst *i, Inst *before) {
+    i->bb = before->bb;
+    before->bb->insts.insert(before, i);
+}
+
+Value *build_bin(OpKind op, Value *a, Value *b, Inst *before) {
+    auto *x = as_a<Const>(a), *y = as_a<Const>(b);
+    if (x && y)
+        return Const::of(eval_bin(op, x->val, y->val));
+    if ((op == tkd::Add || op == tkd::Sub) && y && !y->val)
+        return a;
+    if (op == tkd::Add && x && !x->val)
+        return b;
+    if (op == tkd::Mul && ((x && !x->val) || (y && !y->val)))
+        return &Const::ZERO;
+    if (op == tkd::Mul && x && x->val == 1)
+        return b;
+    if ((op == tkd::Mul || op == tkd::Div) && y && y->val == 1)
+        return a;
+    auto *i = new BinaryInst{op, a, b};
+    insert_before(i, before);
+    return i;
+}
+
+void retarget_phis(BB *succ, BB *from, BB *to) {
+    FOR_INST (i, *succ) {
+        auto *x = as_a<PhiInst>(i);
+        if (!x)
+            break;
+        for (auto &p: x->vals)
+            if (p.second == from)
+                p.second = to;
+    }
+}
+
+BB *split_entry(Func *f) {
+    auto *entry = f->bbs.front, *bb = f->new_bb_after(entry);
+    FOR_LIST_MUT (i, entry->insts) {
+        if (is_a<AllocaInst>(i))
+            continue;
+        entry->erase(i);
+        bb->push(i);
+    }
+    for (auto *v: bb->get_succ())
+        retarget_phis(v, entry, bb);
+    return bb;
+}
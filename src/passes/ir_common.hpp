@@ -6,13 +6,123 @@ using namespace ir;
 
 void build_dom(Func *f);
 void build_pred(Func *f);
+void build_df(Func *f);
 void build_loop(Func *f);
+bool add_pre_headers(Func *f);
+bool in_loop(const BB *bb, const Loop *l);
+BB *get_pre_header(Loop *l);  // null unless it is the only pred outside
+BB *get_latch(Loop *l);  // null unless single
+bool exits_at_latch(Loop *l);
+
+// A basic induction var, as phi = [init, pre_header], [next = phi + step, latch]
+struct IndVar {
+    PhiInst *phi;
+    Value *init;
+    BinaryInst *next;
+    int step;
+};
+
+vector<IndVar> get_ind_vars(Loop *l);
+
+// The test of a loop left only by its latch, which goes on while
+// iv.next op n, with n invariant
+struct ExitTest {
+    IndVar iv;
+    BinaryInst *cmp;
+    OpKind op;
+    Value *n;
+};
+
+bool get_exit_test(Loop *l, ExitTest &res);
+bool get_cond(BranchInst *br, BB *target, Value *lhs, OpKind &op, Value *&rhs);  // when br goes to target, as lhs op rhs
+bool is_guarded(Loop *l, const ExitTest &t);  // entered only if init op n
+uint get_trip_count(const ExitTest &t, uint max);  // 0 if unknown or over max
+
+// Analyses cached in Func::valid. Passes call require() before reading them,
+// and invalidate() what they break once the CFG is changed.
+namespace ana {
+
+enum Kind : uint {
+    Pred = 1, Dom = 2, DF = 4, Loops = 8,
+    All = Pred | Dom | DF | Loops
+};
+
+}
+
+void require(Func *f, uint kinds);
+void invalidate(Func *f, uint kinds = ana::All);
 
 void cg(Prog *f);
 bool dce(Func *f);
 bool dbe(Func *f);
+void mem2reg(Func *f);
+
+// Operands of an inst, listed inline or strided over its args or phi vals
+struct OwnedUses {
+    const Use *fixed[3];
+    const char *base = nullptr;
+    uint n = 0, stride = 0;
+
+    struct iterator {
+        const OwnedUses *r;
+        uint i;
+
+        const Use *operator * () const { return (*r)[i]; }
+        iterator &operator ++ () { ++i; return *this; }
+        bool operator != (const iterator &o) const { return i != o.i; }
+    };
+
+    OwnedUses() = default;
+    OwnedUses(std::initializer_list<const Use *> l);
+    OwnedUses(const Use *first, uint n, uint stride);
 
-vector<const Use *> get_owned_uses(Inst *i);
+    const Use *operator [] (uint i) const {
+        return base ? reinterpret_cast<const Use *>(base + i * stride) : fixed[i];
+    }
+
+    uint size() const { return n; }
+    iterator begin() const { return {this, 0}; }
+    iterator end() const { return {this, n}; }
+};
+
+OwnedUses get_owned_uses(Inst *i);
+
+// Where a MemInst accesses, as the byte offset off from base when has_off.
+// obj is the underlying alloca, global or argument, or null if unknown, and
+// base is obj itself when is_exact.
+struct MemLoc {
+    Value *obj, *base;
+    int off;
+    bool has_off, is_exact;
+};
+
+namespace mr {
+
+enum Kind : uint {
+    None = 0, Ref = 1, Mod = 2,
+    ModRef = Ref | Mod
+};
+
+}
+
+MemLoc get_loc(MemInst *x);
+Value *get_obj(Value *v);  // null if unknown
+bool may_alias(const MemLoc &a, const MemLoc &b);
+bool may_alias(MemInst *a, MemInst *b);
+uint get_mod_ref(CallInst *c, const MemLoc &l);  // of mr::Kind
+uint get_mod_ref(CallInst *c, MemInst *x);
+bool is_safe_to_speculate(const MemLoc &l);
 
 // Erase its uses in phis before dropping
 void drop_bb(BB *u, Func *f);
+
+void insert_before(Inst *i, Inst *before);
+
+// op of a and b, folded if consts or by identities, or else inserted before
+Value *build_bin(OpKind op, Value *a, Value *b, Inst *before);
+
+void retarget_phis(BB *succ, BB *from, BB *to);  // vals of phis in succ by from now come by to
+
+// All but the allocas of the entry go to a new bb after it, which is returned
+// for the caller to branch to
+BB *split_entry(Func *f);
@@ -1,4 +1,5 @@
 #include "ir_common.hpp"
+#include <algorithm>
 
 Loop::Loop(BB *header) : header(header) {}
 
@@ -12,7 +13,7 @@ static void build(BB *u) {
         build(v);
     vector<BB *> latches;
     for (auto *v: u->pred)
-        if (v->dom.count(u))
+        if (u->doms(v))
             latches.push_back(v);
     if (!latches.empty()) {
         auto *loop = new Loop{u};
@@ -65,8 +66,7 @@ static void set_depth(Loop *u, int depth) {
 }
 
 void build_loop(Func *f) {
-    build_dom(f);
-    build_pred(f);
+    require(f, ana::Dom);
     FOR_BB (bb, *f) {
         bb->loop = nullptr;
         bb->vis = false;
@@ -78,4 +78,224 @@ void build_loop(Func *f) {
     build_children(f->bbs.front, f);
     for (auto *loop: f->loop_roots)
         set_depth(loop, 1);
+    f->valid |= ana::Loops;
+}
+
+// Gives each loop a pre_header, which only jumps to its header, so that
+// what is hoisted there runs only when the loop is entered
+bool add_pre_headers(Func *f) {
+    require(f, ana::Loops);
+    vector<BB *> headers;
+    FOR_BB (bb, *f)
+        if (bb->loop && bb->loop->header == bb && bb != f->bbs.front)
+            headers.push_back(bb);
+
+    bool res = false;
+    for (auto *h: headers) {
+        vector<BB *> outside;
+        for (auto *p: h->pred)
+            if (!h->doms(p))
+                outside.push_back(p);
+        if (outside.size() == 1 && is_a<JumpInst>(outside[0]->get_control()))
+            continue;
+
+        auto *pre = f->new_bb_after(h->prev);
+        FOR_INST (i, *h) {
+            if_a (PhiInst, x, i) {
+                PhiInst *y = nullptr;
+                for (auto it = x->vals.begin(); it != x->vals.end(); ) {
+                    if (std::find(outside.begin(), outside.end(), it->second) == outside.end()) {
+                        ++it;
+                        continue;
+                    }
+                    if (outside.size() == 1) {
+                        it->second = pre;
+                        break;
+                    }
+                    if (!y)
+                        y = pre->push(new PhiInst);
+                    y->push(it->first.value, it->second);
+                    it = x->vals.erase(it);
+                }
+                if (y)
+                    x->push(y, pre);
+            } else
+                break;
+        }
+        pre->push(new JumpInst{h});
+        for (auto *p: outside)
+            for (auto **v: p->get_succ_mut())
+                if (*v == h)
+                    *v = pre;
+        res = true;
+    }
+    if (res)
+        invalidate(f);
+    return res;
+}
+
+bool in_loop(const BB *bb, const Loop *l) {
+    for (auto *u = bb->loop; u; u = u->parent)
+        if (u == l)
+            return true;
+    return false;
+}
+
+BB *get_pre_header(Loop *l) {
+    BB *res = nullptr;
+    for (auto *p: l->header->pred)
+        if (!in_loop(p, l)) {
+            if (res)
+                return nullptr;
+            res = p;
+        }
+    return res && res->get_succ().size() == 1 ? res : nullptr;
+}
+
+BB *get_latch(Loop *l) {
+    BB *res = nullptr;
+    for (auto *p: l->header->pred)
+        if (in_loop(p, l)) {
+            if (res)
+                return nullptr;
+            res = p;
+        }
+    return res;
+}
+
+// The loop is left only by the branch in its single latch
+bool exits_at_latch(Loop *l) {
+    auto *latch = get_latch(l);
+    if (!latch)
+        return false;
+    for (auto *bb: l->bbs) {
+        if (bb == latch)
+            continue;
+        if (is_a<ReturnInst>(bb->get_control()))
+            return false;
+        for (auto *v: bb->get_succ())
+            if (!in_loop(v, l))
+                return false;
+    }
+    return true;
+}
+
+// Phis in the header stepped by a const on the back edge
+vector<IndVar> get_ind_vars(Loop *l) {
+    vector<IndVar> res;
+    auto *pre = get_pre_header(l), *latch = get_latch(l);
+    if (!pre || !latch)
+        return res;
+    FOR_INST (i, *l->header) {
+        auto *phi = as_a<PhiInst>(i);
+        if (!phi)
+            break;
+        if (phi->vals.size() != 2)
+            continue;
+        auto &a = phi->vals[0], &b = phi->vals[1];
+        auto &init = a.second == pre ? a : b, &back = a.second == pre ? b : a;
+        auto *next = as_a<BinaryInst>(back.first.value);
+        if (init.second != pre || back.second != latch || !next)
+            continue;
+        Value *other = next->lhs.value == phi ? next->rhs.value : next->rhs.value == phi ? next->lhs.value : nullptr;
+        auto *c = as_a<Const>(other);
+        if (!c || !(next->op == tkd::Add || (next->op == tkd::Sub && next->lhs.value == phi)))
+            continue;
+        int step = next->op == tkd::Add ? c->val : int(-uint(c->val));
+        if (step)
+            res.push_back({phi, init.first.value, next, step});
+    }
+    return res;
+}
+
+static OpKind mirror_op(OpKind op) {
+    switch (op) {
+        case tkd::Lt: return tkd::Gt;
+        case tkd::Gt: return tkd::Lt;
+        case tkd::Le: return tkd::Ge;
+        case tkd::Ge: return tkd::Le;
+        default: return op;
+    }
+}
+
+static OpKind negate_op(OpKind op) {
+    switch (op) {
+        case tkd::Lt: return tkd::Ge;
+        case tkd::Ge: return tkd::Lt;
+        case tkd::Gt: return tkd::Le;
+        case tkd::Le: return tkd::Gt;
+        case tkd::Eq: return tkd::Ne;
+        default: return tkd::Eq;
+    }
+}
+
+bool get_cond(BranchInst *br, BB *target, Value *lhs, OpKind &op, Value *&rhs) {
+    auto *cmp = as_a<BinaryInst>(br->cond.value);
+    if (!cmp || br->bb_then == br->bb_else || (br->bb_then != target && br->bb_else != target))
+        return false;
+    switch (cmp->op) {
+        case tkd::Eq: case tkd::Ne: case tkd::Lt: case tkd::Le: case tkd::Gt: case tkd::Ge:
+            break;
+        default:
+            return false;
+    }
+    if (cmp->lhs.value == lhs) {
+        op = cmp->op;
+        rhs = cmp->rhs.value;
+    } else if (cmp->rhs.value == lhs) {
+        op = mirror_op(cmp->op);
+        rhs = cmp->lhs.value;
+    } else
+        return false;
+    if (br->bb_then != target)
+        op = negate_op(op);
+    return true;
+}
+
+bool get_exit_test(Loop *l, ExitTest &res) {
+    if (!exits_at_latch(l))
+        return false;
+    auto *br = as_a<BranchInst>(get_latch(l)->get_control());
+    if (!br)
+        return false;
+    for (auto &iv: get_ind_vars(l)) {
+        OpKind op;
+        Value *n;
+        if (!get_cond(br, l->header, iv.next, op, n))
+            continue;
+        auto *i = as_a<Inst>(n);
+        if (i && in_loop(i->bb, l))
+            continue;
+        res = {iv, static_cast<BinaryInst *>(br->cond.value), op, n};
+        return true;
+    }
+    return false;
+}
+
+// By the branch to the pre_header, or by init and n when both are const
+bool is_guarded(Loop *l, const ExitTest &t) {
+    auto *init = as_a<Const>(t.iv.init), *n = as_a<Const>(t.n);
+    if (init && n)
+        return eval_bin(t.op, init->val, n->val);
+    auto *pre = get_pre_header(l);
+    if (!pre || pre->pred.size() != 1)
+        return false;
+    auto *br = as_a<BranchInst>(pre->pred.front()->get_control());
+    OpKind op;
+    Value *rhs;
+    return br && get_cond(br, pre, t.iv.init, op, rhs) && op == t.op && rhs == t.n;
+}
+
+// Iterations per entry, simulated with a const init and n
+uint get_trip_count(const ExitTest &t, uint max) {
+    auto *init = as_a<Const>(t.iv.init), *n = as_a<Const>(t.n);
+    if (!init || !n)
+        return 0;
+    int v = init->val;
+    for (uint k = 1; k <= max; ++k) {
+        v = int(uint(v) + uint(t.iv.step));
+        if (!eval_bin(t.op, v, n->val))
+            return k;
+    }
+    return 0;
 }
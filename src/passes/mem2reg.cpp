@@ -1,8 +1,7 @@
 #include "ir_common.hpp"
 
 void build_df(Func *f) {
-    build_dom(f);
-    build_pred(f);
+    require(f, ana::Dom);
 
     FOR_BB (u, *f)
         u->df.clear();
@@ -16,15 +15,22 @@ void build_df(Func *f) {
             }
         }
     }
+    f->valid |= ana::DF;
 }
 
-// requires dbe
+// Phis are placed at the iterated df of stores where the var is live in,
+// as found backwards from the bbs loading it before any store. Renaming walks
+// the dom tree with a stack of values for each var. Requires dbe, and bbs are
+// indexed by po.
 void mem2reg(Func *f) {
-    build_df(f);
+    require(f, ana::DF);
 
     vector<AllocaInst *> allocas;
+    uint m = 0;
     FOR_BB_INST (i, bb, *f) {
-        if_a (AllocaInst, a, i) {
+        if_a (PhiInst, x, i)
+            x->aid = -1;  // from an earlier run
+        else if_a (AllocaInst, a, i) {
             if (a->var->dims.empty()) { // promotable
                 a->aid = int(allocas.size());
                 allocas.push_back(a);
@@ -32,52 +38,87 @@ void mem2reg(Func *f) {
             } else
                 a->aid = -1;
         }
+        m = std::max(m, bb->po + 1);
     }
     uint n = allocas.size();
 
     {
-        auto *def_bbs = new vector<BB *>[n];
+        vector<vector<BB *>> def_bbs(n), use_bbs(n);  // may repeat
+        vector<uint> stored(n, uint(-1));  // po of the last bb storing it
         FOR_BB_INST (i, bb, *f)
-            if_a (StoreInst, s, i)
+            if_a (StoreInst, s, i) {
                 if_a (AllocaInst, a, s->base.value)
                     if (a->aid >= 0) {
                         def_bbs[a->aid].push_back(bb);
-                        info("found def bb_%d for alloca %d", bb->id, a->aid);
+                        stored[a->aid] = bb->po;
                     }
-        // okay to push the same bb for multiple times due to checking bb->vis
+            } else if_a (LoadInst, l, i) {
+                if_a (AllocaInst, a, l->base.value)
+                    if (a->aid >= 0 && stored[a->aid] != bb->po)
+                        use_bbs[a->aid].push_back(bb);
+            }
 
+        // Marks by the var plus one, to be never cleared
+        vector<uint> is_def(m), is_live(m), has_phi(m);
         vector<BB *> wl;
         for (uint i = 0; i < n; ++i) {
-            FOR_BB (bb, *f)
-                bb->vis = false;
-            for (auto *bb : def_bbs[i]) if (!bb->vis)
-                wl.push_back(bb); // vis shouldn't be set here, for these bb-s haven't been placed phi nodes yet
+            uint mark = i + 1;
+            if (use_bbs[i].empty())
+                continue;  // never loaded before a store
+            for (auto *bb: def_bbs[i])
+                is_def[bb->po] = mark;
+            for (auto *bb: use_bbs[i])
+                if (is_live[bb->po] != mark) {
+                    is_live[bb->po] = mark;
+                    wl.push_back(bb);
+                }
+            while (!wl.empty()) {
+                auto *u = wl.back();
+                wl.pop_back();
+                for (auto *p: u->pred)
+                    if (is_live[p->po] != mark && is_def[p->po] != mark) {
+                        is_live[p->po] = mark;
+                        wl.push_back(p);
+                    }
+            }
 
+            for (auto *bb: def_bbs[i])
+                wl.push_back(bb);
             while (!wl.empty()) {
                 auto *u = wl.back();
                 wl.pop_back();
-                for (BB *v : u->df) if (!v->vis) {
-                    infof("alloca", i, "put phi at bb", v->id, "which is in df of bb", u->id);
-                    wl.push_back(v);
-                    v->vis = true;
-                    v->push_front(new PhiInst)->aid = int(i);
+                for (BB *v : u->df) if (has_phi[v->po] != mark) {
+                    has_phi[v->po] = mark;
+                    if (is_live[v->po] == mark) {
+                        infof("alloca", i, "put phi at bb", v->id, "which is in df of bb", u->id);
+                        v->push_front(new PhiInst)->aid = int(i);
+                    }
+                    if (is_def[v->po] != mark)
+                        wl.push_back(v);
                 }
             }
         }
-        delete []def_bbs;
     }
 
     FOR_BB (bb, *f)
         bb->vis = false;
-    f->bbs.front->vis = true;
-    vector<std::pair<BB *, vector<Value *>>> wl{
-        {{f->bbs.front, {n, &Undef::VAL}}}
+    vector<vector<Value *>> vals(n);
+    vector<uint> pushed;  // aids, to be popped as a bb is left
+    vector<std::pair<BB *, uint>> wl{{f->bbs.front, 0}};
+    auto top = [&](int aid) -> Value * {
+        return vals[aid].empty() ? &Undef::VAL : vals[aid].back();
     };
-    do {
-        auto &s = wl.back();
-        auto *bb = s.first;
-        auto vals = std::move(s.second);
-        wl.pop_back();
+    while (!wl.empty()) {
+        auto *bb = wl.back().first;
+        if (bb->vis) {
+            for (uint k = wl.back().second; k < pushed.size(); ++k)
+                vals[pushed[k]].pop_back();
+            pushed.resize(wl.back().second);
+            bb->vis = false;
+            wl.pop_back();
+            continue;
+        }
+        bb->vis = true;
         for (auto *i = bb->insts.front; i; ) {
             auto *next = i->next;
             if_a (AllocaInst, x, i) {
@@ -87,7 +128,7 @@ void mem2reg(Func *f) {
                 if_a (AllocaInst, a, x->base.value) {
                     if (a->aid >= 0) {
                         x->lhs->value = nullptr;  // param codegen uses this!
-                        bb->erase_with(x, vals[a->aid]);
+                        bb->erase_with(x, top(a->aid));
                         delete x;
                     }
                 }
@@ -95,31 +136,31 @@ void mem2reg(Func *f) {
                 if_a (AllocaInst, a, x->base.value) {
                     if (a->aid >= 0) {
                         x->lhs->value = nullptr;
-                        vals[a->aid] = x->val.value; // no need to release()
+                        vals[a->aid].push_back(x->val.value); // no need to release()
+                        pushed.push_back(a->aid);
                         bb->erase(x);
                         delete x;
                     }
                 }
             } else if_a (PhiInst, x, i) {
-                if (x->aid >= 0)
-                    vals[x->aid] = x;
+                if (x->aid >= 0) {
+                    vals[x->aid].push_back(x);
+                    pushed.push_back(x->aid);
+                }
             }
             i = next;
         }
-        for (BB *v : bb->get_succ()) {
+        for (BB *v : bb->get_succ())
             FOR_INST (i, *v) {
                 if_a (PhiInst, x, i) {
                     if (x->aid >= 0)
-                        x->push(vals[x->aid], bb);
+                        x->push(top(x->aid), bb);
                 } else
                     break;
             }
-            if (!v->vis) {
-                v->vis = true;
-                wl.emplace_back(v, vals);
-            }
-        }
-    } while (!wl.empty());
+        for (auto *v: bb->dom_chs)
+            wl.emplace_back(v, uint(pushed.size()));
+    }
 
     for (auto *a: allocas)
         delete a;
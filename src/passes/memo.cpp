@@ -0,0 +1,116 @@
+#include "ir_common.hpp"
+#include "passes.hpp"
+#include <algorithm>
+
+// Memoization of pure functions recursing more than once on one or two int
+// params used, after tre. Each gets a table in .data of a flag and a result for
+// every args in a bounded range, looked up on entry and filled before each
+// return. Args out of the range run the body as before, and fill a dummy slot
+// after the table, which is never looked up.
+
+namespace {
+
+constexpr int RANGE_1 = 1024;  // of the param, if only one
+constexpr int RANGE_2 = 32;  // of each param, if two
+
+struct Memoizer {
+    Func *f;
+    Decl *table;
+    vector<Argument *> args;  // used, as the key
+    BB *body;
+    vector<BB *> misses;  // branching to body with args out of the range
+
+    GEPInst *slot(BB *bb, Value *idx) {
+        return bb->push(new GEPInst{table, table->value, idx, 8});
+    }
+
+    // Branches to the next bb made if a op k, or to body otherwise
+    BB *check(BB *bb, Value *a, OpKind op, int k) {
+        auto *next = f->new_bb_after(bb);
+        bb->push(new BranchInst{bb->push(new BinaryInst{op, a, Const::of(k)}), next, body});
+        misses.push_back(bb);
+        return next;
+    }
+
+    // Linear recursion gains little, as each call is looked up once
+    bool init(Func *func) {
+        f = func;
+        args.clear();
+        if (!f->is_pure || !f->returns_int)
+            return false;
+        uint self_calls = 0;
+        FOR_BB_INST (i, bb, *f) {
+            for (auto *u: get_owned_uses(i))
+                if_a (Argument, x, u->value)
+                    if (std::find(args.begin(), args.end(), x) == args.end())
+                        args.push_back(x);
+            if_a (CallInst, x, i)
+                if (x->func == f)
+                    ++self_calls;
+        }
+        for (auto *x: args)
+            if (!x->var->dims.empty())
+                return false;
+        return self_calls >= 2 && !args.empty() && args.size() <= 2;
+    }
+
+    void run(Prog *prog) {
+        int range = args.size() == 1 ? RANGE_1 : RANGE_2;
+        int size = args.size() == 1 ? RANGE_1 : RANGE_2 * RANGE_2;
+        infof(f->name, ": memoizing by", size, "slots");
+
+        // Labels are prefixed, so this never clashes with an identifier
+        table = new Decl{false, "0memo_" + f->name};
+        table->is_global = true;
+        table->is_memo = true;
+        table->dims = {size + 1, 2};
+        table->value = new Global{table};
+        prog->globals.push_back(table);
+
+        vector<ReturnInst *> rets;
+        FOR_BB_INST (i, bb, *f)
+            if_a (ReturnInst, x, i)
+                rets.push_back(x);
+
+        auto *entry = f->bbs.front;
+        body = split_entry(f);
+
+        auto *dummy = slot(entry, Const::of(size));
+        misses.clear();
+        BB *bb = entry;
+        for (auto *x: args) {
+            bb = check(bb, x, tkd::Ge, 0);
+            bb = check(bb, x, tkd::Lt, range);
+        }
+        Value *idx = args[0];
+        if (args.size() == 2)
+            idx = bb->push(new BinaryInst{tkd::Add,
+                bb->push(new BinaryInst{tkd::Mul, idx, Const::of(RANGE_2)}), args[1]});
+        auto *s = slot(bb, idx);
+        auto *hit = f->new_bb_after(bb);
+        bb->push(new BranchInst{bb->push(new LoadInst{table, s, &Const::ZERO}), hit, body});
+        hit->push(new ReturnInst{hit->push(new LoadInst{table, s, Const::of(4)})});
+
+        auto *p = body->push_front(new PhiInst);
+        for (auto *u: misses)
+            p->push(dummy, u);
+        p->push(s, bb);
+        for (auto *r: rets)
+            for (Inst *i: {(Inst *) new StoreInst{table, p, Const::of(4), r->val.value},
+                           (Inst *) new StoreInst{table, p, &Const::ZERO, Const::of(1)}})
+                insert_before(i, r);
+        invalidate(f);
+    }
+};
+
+}
+
+// Opt in by --memoize, after cg
+void memo(Prog *prog) {
+    if (!use_memoize)
+        return;
+    Memoizer m;
+    for (auto &f: prog->funcs)
+        if (m.init(&f))
+            m.run(prog);
+}
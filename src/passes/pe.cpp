@@ -0,0 +1,179 @@
+#include "interp.hpp"
+#include "passes.hpp"
+#include <algorithm>
+
+// Partial evaluation of the whole program, by running main in the
+// interpreter. If it ends, main just prints what it has printed, and nothing
+// else is left. If it stops at its first getint, met in main out of any loop,
+// main resumes right there: what it has printed is printed at once, globals
+// modified take their contents as inits, arrays of main become such globals
+// too, and values defined before are replaced by what they are by then.
+
+namespace {
+
+constexpr uint FUEL = 1 << 25;
+
+// Only \n is escaped in fmts, and nothing printed has % or "
+string to_fmt(const string &s) {
+    string r = "\"";
+    for (char c: s)
+        if (c == '\n')
+            r += "\\n";
+        else
+            r += c;
+    return r + '"';
+}
+
+void set_init(Decl *d, const vector<int> &img) {
+    d->init.clear();
+    d->has_init = std::any_of(img.begin(), img.end(), [](int x) { return x != 0; });
+    if (d->has_init)
+        for (int x: img)
+            d->init.push_back(new ast::Number(x));
+}
+
+struct Evaluator {
+    Prog *prog;
+    Func *main;
+    Interp in{prog, FUEL};
+    BB *entry;
+    std::map<int, Decl *> objs;  // globals and arrays of main, by obj
+    std::map<Decl *, Decl *> moved;  // arrays of main to their globals
+    std::map<std::pair<int, int>, Value *> ptrs;
+
+    Evaluator(Prog *prog, Func *main) : prog(prog), main(main) {}
+
+    Value *get(const Interp::Val &v) {
+        if (v.obj == -1)
+            return Const::of(v.i);
+        if (v.obj < 0)
+            return &Undef::VAL;
+        auto *d = objs.at(v.obj);
+        if (!v.i)
+            return d->value;
+        auto &p = ptrs[{v.obj, v.i}];
+        if (!p)
+            p = entry->push(new GEPInst{d, d->value, Const::of(v.i), 1});
+        return p;
+    }
+
+    void print(const string &s) {
+        if (s.empty())
+            return;
+        prog->printfs.emplace_back(to_fmt(s));
+        entry->push(new CallInst{&prog->printfs.back()});
+    }
+
+    void fold_all() {
+        infof("pe: folding the whole program into", in.out.size(), "chars");
+        split_entry(main);  // left to dbe, to start main anew
+        print(in.out);
+        entry->push(new ReturnInst{nullptr});
+        for (auto &f: prog->funcs)
+            if (&f != main)
+                f.is_unused = true;
+        prog->globals.clear();
+    }
+
+    // Splits the bb at the call, which is then the first of its bb
+    BB *split_at(Inst *call) {
+        auto *bb = call->bb, *to = main->new_bb_after(bb);
+        for (Inst *i = call; i; ) {
+            auto *next = i->next;
+            bb->erase(i);
+            to->push(i);
+            i = next;
+        }
+        bb->push(new JumpInst{to});
+        for (auto *v: to->get_succ())
+            retarget_phis(v, bb, to);
+        return to;
+    }
+
+    void fold_prefix() {
+        auto &fr = in.stack.front();
+        auto *call = fr.pc;
+        infof("pe: resuming main from bb", call->bb->id, "after", in.out.size(), "chars");
+
+        for (auto *d: prog->globals)
+            objs[in.globals.at(d)] = d;
+        FOR_BB_INST (i, bb, *main)
+            if_a (AllocaInst, x, i) {
+                int obj = fr.vals[x->id].obj;
+                if (obj < 0)
+                    continue;
+                auto *d = new Decl{false, "0" + std::to_string(obj) + "_" + x->var->name};
+                d->dims = x->var->dims;
+                d->is_global = true;
+                d->value = new Global{d};
+                prog->globals.push_back(d);
+                objs[obj] = moved[x->var] = d;
+            }
+        for (auto &p: objs)
+            if (!p.second->is_const)
+                set_init(p.second, in.mem[p.first]);
+
+        auto *resume = split_at(call);
+        split_entry(main);
+        std::set<BB *> live{resume};
+        vector<BB *> wl{resume};
+        while (!wl.empty()) {
+            auto *u = wl.back();
+            wl.pop_back();
+            for (auto *v: u->get_succ())
+                if (live.insert(v).second)
+                    wl.push_back(v);
+        }
+        vector<Inst *> defs;  // before, as geps made go to the entry
+        FOR_BB_INST (i, bb, *main) {
+            if (!live.count(bb))
+                defs.push_back(i);
+            else if_a (MemInst, x, i) {
+                auto it = moved.find(x->lhs);
+                if (it != moved.end())
+                    x->lhs = it->second;
+            }
+        }
+        for (auto *i: defs)
+            FOR_LIST_MUT (u, i->uses)
+                if (live.count(u->user->bb))
+                    u->set(get(fr.vals[i->id]));
+        print(in.out);
+        entry->push(new JumpInst{resume});
+    }
+
+    bool run() {
+        entry = main->bbs.front;
+        auto s = in.run_main(main);
+        if (s == Interp::Done) {
+            fold_all();
+            return true;
+        }
+        if (s != Interp::Input || in.stack.size() != 1)
+            return false;
+        require(main, ana::Pred | ana::Loops);
+        if (!entry->pred.empty() || in.stack.front().pc->bb->loop)
+            return false;
+        fold_prefix();
+        return true;
+    }
+};
+
+}
+
+// Opt in by --pe, as the whole backend is skipped for programs taking no input
+bool pe(Prog *prog) {
+    if (!use_pe)
+        return false;
+    Func *main = nullptr;
+    for (auto &f: prog->funcs)
+        if (f.name == "main")
+            main = &f;
+    if (!main)
+        return false;
+    Evaluator e{prog, main};
+    if (!e.run())
+        return false;
+    invalidate(main);
+    return true;
+}
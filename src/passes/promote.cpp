@@ -0,0 +1,214 @@
+#include "ir_common.hpp"
+#include <algorithm>
+
+// Promotes memory locations accessed in a loop into scalars, by loading them
+// in the pre_header and storing them back on exits. The scalars live in new
+// allocas which mem2reg turns into phis at last. A location is a global
+// scalar or an array cell at a const or loop invariant offset, and it must
+// be touched by no call and no other access in the loop that may alias it.
+
+namespace {
+
+constexpr uint MAX_PROMOTED = 4;  // per loop
+
+using Key = std::pair<Value *, Value *>;  // base and off
+
+struct Promoter {
+    Func *f;
+    Loop *loop;
+    BB *pre_header;
+    vector<std::pair<Key, vector<MemInst *>>> keys;
+    vector<MemInst *> accesses;
+    vector<CallInst *> calls;
+    vector<BB *> exiting, exits;
+    vector<ReturnInst *> rets;
+    vector<Value *> promoted;
+
+    bool contains(BB *bb) const {
+        return in_loop(bb, loop);
+    }
+
+    bool is_invariant(Value *v) const {
+        auto *i = as_a<Inst>(v);
+        return !i || !contains(i->bb);
+    }
+
+    static Key get_key(MemInst *x, const MemLoc &l) {
+        if (l.is_exact)
+            return {l.obj, Const::of(l.off)};
+        return {x->base.value, x->off.value};
+    }
+
+    void collect() {
+        keys.clear();
+        accesses.clear();
+        calls.clear();
+        exiting.clear();
+        rets.clear();
+        promoted.clear();
+        for (auto *bb: loop->bbs) {
+            FOR_INST (i, *bb) {
+                if (is_a<LoadInst>(i) || is_a<StoreInst>(i)) {
+                    auto *x = static_cast<MemInst *>(i);
+                    accesses.push_back(x);
+                    auto l = get_loc(x);
+                    if_a (AllocaInst, a, l.obj)
+                        if (a->var->dims.empty()) {  // promoted already
+                            if (std::find(promoted.begin(), promoted.end(), a) == promoted.end())
+                                promoted.push_back(a);
+                            continue;
+                        }
+                    auto k = get_key(x, l);
+                    auto it = std::find_if(keys.begin(), keys.end(),
+                        [&](const std::pair<Key, vector<MemInst *>> &p) { return p.first == k; });
+                    if (it == keys.end())
+                        keys.emplace_back(k, vector<MemInst *>{x});
+                    else
+                        it->second.push_back(x);
+                } else if_a (CallInst, x, i)
+                    calls.push_back(x);
+                else if_a (ReturnInst, x, i)
+                    rets.push_back(x);
+            }
+            for (auto *v: bb->get_succ())
+                if (!contains(v)) {
+                    exiting.push_back(bb);
+                    break;
+                }
+        }
+    }
+
+    bool can_promote(const Key &k, const vector<MemInst *> &xs) {
+        auto l = get_loc(xs.front());
+        if (!l.obj || !is_invariant(k.first) || !is_invariant(k.second))
+            return false;
+        for (auto *y: accesses)
+            if (std::find(xs.begin(), xs.end(), y) == xs.end() && may_alias(l, get_loc(y)))
+                return false;
+        for (auto *c: calls)
+            if (get_mod_ref(c, l) != mr::None)
+                return false;
+        if (is_safe_to_speculate(l))
+            return true;
+        // Otherwise it must be accessed whenever the loop is entered
+        return std::any_of(xs.begin(), xs.end(), [&](MemInst *x) {
+            return std::all_of(exiting.begin(), exiting.end(), [&](BB *u) { return x->bb->doms(u); }) &&
+                std::all_of(rets.begin(), rets.end(), [&](ReturnInst *r) { return x->bb->doms(r->bb); });
+        });
+    }
+
+    // Splits each edge leaving the loop, for stores on them
+    bool split_exits() {
+        if (!exits.empty())
+            return true;
+        for (auto *u: exiting) {
+            auto succ = u->get_succ();
+            if (succ.size() == 2 && succ[0] == succ[1])
+                return false;
+        }
+        for (auto *u: exiting)
+            for (auto **p: u->get_succ_mut()) {
+                auto *v = *p;
+                if (contains(v))
+                    continue;
+                auto *bb = f->new_bb_after(u);
+                bb->push(new JumpInst{v});
+                *p = bb;
+                FOR_INST (i, *v) {
+                    if_a (PhiInst, x, i) {
+                        for (auto &p: x->vals)
+                            if (p.second == u)
+                                p.second = bb;
+                    } else
+                        break;
+                }
+                exits.push_back(bb);
+            }
+        return true;
+    }
+
+    bool promote(const Key &k, const vector<MemInst *> &xs) {
+        bool stored = std::any_of(xs.begin(), xs.end(), [](MemInst *x) { return is_a<StoreInst>(x); });
+        if (stored && !split_exits())
+            return false;
+        auto *lhs = xs.front()->lhs;
+        infof(f->name, ": promoting", lhs->name, "in loop with header bb", loop->header->id);
+
+        auto *d = new Decl{false, lhs->name};
+        auto *var = f->bbs.front->push_front(new AllocaInst{d});
+        auto *ctrl = pre_header->get_control();
+        auto *init = new LoadInst{lhs, k.first, k.second};
+        for (Inst *i: {(Inst *) init, (Inst *) new StoreInst{d, var, &Const::ZERO, init}})
+            insert_before(i, ctrl);
+        for (auto *x: xs) {
+            x->lhs = d;
+            x->base.set(var);
+            x->off.set(&Const::ZERO);
+        }
+        if (!stored)
+            return true;
+
+        auto write_back = [&](Inst *before) {
+            auto *val = new LoadInst{d, var, &Const::ZERO};
+            for (Inst *i: {(Inst *) val, (Inst *) new StoreInst{lhs, k.first, k.second, val}})
+                insert_before(i, before);
+        };
+        for (auto *bb: exits)
+            write_back(bb->get_control());
+        for (auto *r: rets)
+            write_back(r);
+        return true;
+    }
+
+    bool run(Func *func, Loop *l) {
+        f = func;
+        loop = l;
+        if (loop->header == f->bbs.front)
+            return false;  // which has no pre_header
+        pre_header = nullptr;
+        for (auto *p: loop->header->pred)
+            if (!contains(p))
+                pre_header = p;
+        exits.clear();
+        collect();
+
+        // Most accessed first, as each takes a register across the loop
+        std::stable_sort(keys.begin(), keys.end(), [](const std::pair<Key, vector<MemInst *>> &a,
+                const std::pair<Key, vector<MemInst *>> &b) {
+            return a.second.size() > b.second.size();
+        });
+        uint n = promoted.size();
+        bool res = false;
+        for (auto &p: keys)
+            if (n < MAX_PROMOTED && can_promote(p.first, p.second) && promote(p.first, p.second)) {
+                ++n;
+                res = true;
+            }
+        return res;
+    }
+};
+
+bool promote_in(Promoter &pr, Func *f, const vector<Loop *> &loops) {
+    for (auto *l: loops)
+        if (pr.run(f, l) || promote_in(pr, f, l->chs))
+            return true;
+    return false;
+}
+
+}
+
+// Outer loops are tried first, where the CFG is rebuilt after each change
+void promote(Func *f) {
+    Promoter pr;
+    bool changed = false;
+    while (true) {
+        add_pre_headers(f);
+        require(f, ana::Loops);
+        if (!promote_in(pr, f, f->loop_roots))
+            break;
+        invalidate(f);
+        changed = true;
+    }
+    if (changed)
+        mem2reg(f);
+}
@@ -0,0 +1,201 @@
+#include "ir_common.hpp"
+#include <unordered_map>
+#include <algorithm>
+
+// Wegman & Zadeck, sparse conditional constant propagation, run over SSA
+// values and CFG edges together. Loads from const decls at const offsets are
+// folded as well. Known conds are left in branches for dbe to fold.
+
+namespace {
+
+struct Lattice {
+    enum State {
+        Top, Known, Bottom
+    } state;
+    int val;
+
+    Lattice(State state = Top, int val = 0) : state(state), val(val) {}
+
+    bool meet(const Lattice &o) {
+        if (o.state == Top || state == Bottom)
+            return false;
+        if (state == Top)
+            *this = o;
+        else if (o.state == Bottom || o.val != val)
+            state = Bottom;
+        else
+            return false;
+        return true;
+    }
+};
+
+const Lattice BOTTOM{Lattice::Bottom, 0};
+
+struct SCCP {
+    Func *f;
+    std::unordered_map<Value *, Lattice> lat;
+    vector<vector<BB *>> exec_pred;  // preds by executable edges, by bb id
+    vector<bool> reachable;
+    vector<BB *> bb_wl;
+    vector<Inst *> inst_wl;
+
+    Lattice get(Value *v) {
+        if_a (ir::Const, x, v)
+            return {Lattice::Known, x->val};
+        if (is_a<Inst>(v)) {
+            auto it = lat.find(v);
+            return it == lat.end() ? Lattice{} : it->second;
+        }
+        return BOTTOM;  // args, globals and undef
+    }
+
+    void lower(Inst *i, const Lattice &l) {
+        if (lat[i].meet(l))
+            for (auto *u = i->uses.front; u; u = u->next)
+                if (reachable[u->user->bb->id])
+                    inst_wl.push_back(u->user);
+    }
+
+    void mark_edge(BB *u, BB *v) {
+        auto &p = exec_pred[v->id];
+        if (std::find(p.begin(), p.end(), u) != p.end())
+            return;
+        p.push_back(u);
+        if (!reachable[v->id]) {
+            reachable[v->id] = true;
+            bb_wl.push_back(v);
+            return;
+        }
+        FOR_INST (i, *v) {
+            if (is_a<PhiInst>(i))
+                inst_wl.push_back(i);
+            else
+                break;
+        }
+    }
+
+    // Byte offset of the element a load reads from its const decl
+    bool get_offset(LoadInst *x, int &off) {
+        auto o = get(x->off.value);
+        if (o.state != Lattice::Known)
+            return false;
+        off = o.val;
+        auto *base = x->base.value;
+        if_a (GEPInst, g, base) {
+            auto go = get(g->off.value);
+            if (go.state != Lattice::Known)
+                return false;
+            off += go.val * g->size;
+            base = g->base.value;
+        }
+        return is_a<Global>(base) || is_a<AllocaInst>(base);
+    }
+
+    Lattice eval_load(LoadInst *x) {
+        int off;
+        auto *d = x->lhs;
+        if (!d->is_const || !get_offset(x, off) || off < 0 || off % 4)
+            return BOTTOM;
+        uint idx = uint(off) >> 2;
+        if (idx >= d->init.size())
+            return BOTTOM;
+        if_a (ast::Number, n, d->init[idx])
+            return {Lattice::Known, n->val};
+        return BOTTOM;
+    }
+
+    Lattice eval_bin(BinaryInst *x) {
+        auto l = get(x->lhs.value), r = get(x->rhs.value);
+        if (l.state == Lattice::Bottom || r.state == Lattice::Bottom)
+            return BOTTOM;
+        if (l.state == Lattice::Top || r.state == Lattice::Top)
+            return {};
+        if ((x->op == tkd::Div || x->op == tkd::Mod) &&
+            (r.val == 0 || (l.val == ir::Const::MIN && r.val == -1)))
+            return BOTTOM;
+        return {Lattice::Known, ir::eval_bin(x->op, l.val, r.val)};
+    }
+
+    void visit_branch(BB *bb, const Lattice &c, BB *bb_then, BB *bb_else) {
+        if (c.state == Lattice::Bottom) {
+            mark_edge(bb, bb_then);
+            mark_edge(bb, bb_else);
+        } else if (c.state == Lattice::Known)
+            mark_edge(bb, c.val ? bb_then : bb_else);
+    }
+
+    void visit(Inst *i) {
+        auto *bb = i->bb;
+        if_a (PhiInst, x, i) {
+            Lattice l;
+            auto &p = exec_pred[bb->id];
+            for (auto &v: x->vals)
+                if (std::find(p.begin(), p.end(), v.second) != p.end())
+                    l.meet(get(v.first.value));
+            lower(x, l);
+        } else if_a (BinaryInst, x, i)
+            lower(x, eval_bin(x));
+        else if_a (LoadInst, x, i)
+            lower(x, eval_load(x));
+        else if_a (BranchInst, x, i)
+            visit_branch(bb, get(x->cond.value), x->bb_then, x->bb_else);
+        else if_a (BinaryBranchInst, x, i) {
+            auto l = get(x->lhs.value), r = get(x->rhs.value);
+            Lattice c;
+            if (l.state == Lattice::Bottom || r.state == Lattice::Bottom)
+                c = BOTTOM;
+            else if (l.state == Lattice::Known && r.state == Lattice::Known)
+                c = {Lattice::Known, rel::eval(x->op, l.val, r.val)};
+            visit_branch(bb, c, x->bb_then, x->bb_else);
+        } else if_a (JumpInst, x, i)
+            mark_edge(bb, x->bb_to);
+        else if (!is_a<ReturnInst>(i))
+            lower(i, BOTTOM);
+    }
+
+    bool run(Func *func) {
+        f = func;
+        lat.clear();
+        exec_pred.assign(f->bb_cnt, {});
+        reachable.assign(f->bb_cnt, false);
+        reachable[f->bbs.front->id] = true;
+        bb_wl.push_back(f->bbs.front);
+
+        while (!(bb_wl.empty() && inst_wl.empty())) {
+            while (!inst_wl.empty()) {
+                auto *i = inst_wl.back();
+                inst_wl.pop_back();
+                visit(i);
+            }
+            if (!bb_wl.empty()) {
+                auto *bb = bb_wl.back();
+                bb_wl.pop_back();
+                FOR_INST (i, *bb)
+                    visit(i);
+            }
+        }
+
+        bool res = false;
+        FOR_BB (bb, *f) if (reachable[bb->id]) {
+            FOR_LIST_MUT (i, bb->insts) {
+                auto it = lat.find(i);
+                if (it == lat.end() || it->second.state != Lattice::Known)
+                    continue;
+                infof(f->name, ": sccp folds an inst to", it->second.val);
+                bb->erase_with(i, ir::Const::of(it->second.val));
+                delete i;
+                res = true;
+            }
+        }
+        infof(f->name, ": sccp done");
+        return res;
+    }
+};
+
+}
+
+// Unreachable bbs are left for dbe to drop, along with branches on folded conds
+bool sccp(Func *f) {
+    static SCCP s;
+    return s.run(f);
+}
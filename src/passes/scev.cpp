@@ -0,0 +1,296 @@
+#include "ir_common.hpp"
+#include <cstdlib>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+
+// Scalar evolution in loops left only by the exit test of a basic iv. Values
+// are taken as chrecs of the iteration k, as c0 + c1 k + c2 C(k, 2) with coefs
+// invariant, which header phis get by adding chrecs of lower degrees to
+// themselves each iteration. Values used out of a loop without side effects
+// are replaced by their chrecs at the last iteration, so dle drops the loop.
+// Where computing the trip count may overflow, the loop is kept, and skipped
+// only if a check in the pre_header passes. Loops stepped by 1 or -1 are taken
+// to run below 2^31 times.
+
+namespace {
+
+constexpr uint MAX_DEGREE = 2;
+constexpr uint MAX_CONST_TRIPS = 1 << 16;
+
+using Chrec = vector<Value *>;  // coefs of C(k, j), by j, empty if unknown
+
+// A chrec plus self times the phi being solved
+struct Expr {
+    int self;
+    Chrec c;
+};
+
+struct Evolution {
+    Func *f;
+    Loop *loop;
+    BB *pre_header;
+    ExitTest t;
+    std::unordered_map<PhiInst *, Chrec> phis;
+    std::unordered_set<PhiInst *> solving;
+    std::map<std::pair<Value *, PhiInst *>, Expr> exprs;
+    std::unordered_set<BinaryInst *> fixed;  // not to be hoisted
+    std::unordered_set<BB *> done;  // headers of loops tried
+
+    explicit Evolution(Func *f) : f(f) {}
+
+    Inst *at() const {
+        return pre_header->get_control();
+    }
+
+    Chrec combine(OpKind op, const Chrec &a, const Chrec &b) {
+        Chrec r(std::max(a.size(), b.size()), &Const::ZERO);
+        for (uint j = 0; j < r.size(); ++j)
+            r[j] = build_bin(op, j < a.size() ? a[j] : &Const::ZERO, j < b.size() ? b[j] : &Const::ZERO, at());
+        return r;
+    }
+
+    Chrec scale(const Chrec &a, Value *k) {
+        Chrec r;
+        for (auto *c: a)
+            r.push_back(build_bin(tkd::Mul, c, k, at()));
+        return r;
+    }
+
+    // Arithmetic on invariants, as left by inner loops, is moved to the
+    // pre_header, save divisions that may trap
+    bool hoist(BinaryInst *x) {
+        if (!in_loop(x->bb, loop))
+            return true;
+        if (fixed.count(x))
+            return false;
+        auto *d = as_a<Const>(x->rhs.value);
+        if ((x->op == tkd::Div || x->op == tkd::Mod) && (!d || !d->val || d->val == -1)) {
+            fixed.insert(x);
+            return false;
+        }
+        for (auto *v: {x->lhs.value, x->rhs.value}) {
+            auto *i = as_a<Inst>(v);
+            if (i && in_loop(i->bb, loop) && !(is_a<BinaryInst>(i) && hoist(static_cast<BinaryInst *>(i)))) {
+                fixed.insert(x);
+                return false;
+            }
+        }
+        x->bb->erase(x);
+        insert_before(x, at());
+        return true;
+    }
+
+    // Fails with an empty chrec
+    Expr eval(Value *v, PhiInst *self) {
+        auto it = exprs.find({v, self});
+        if (it != exprs.end())
+            return it->second;
+        return exprs[{v, self}] = eval_new(v, self);
+    }
+
+    Expr eval_new(Value *v, PhiInst *self) {
+        if (v == self)
+            return {1, {&Const::ZERO}};
+        auto *i = as_a<Inst>(v);
+        if (!i || !in_loop(i->bb, loop))
+            return {0, {v}};
+        if_a (PhiInst, x, i)
+            return {0, solve(x)};
+        auto *x = as_a<BinaryInst>(i);
+        if (!x)
+            return {0, {}};
+        if (hoist(x))
+            return {0, {x}};
+        auto l = eval(x->lhs.value, self), r = eval(x->rhs.value, self);
+        if (l.c.empty() || r.c.empty())
+            return {0, {}};
+        if (x->op == tkd::Add || x->op == tkd::Sub)
+            return {x->op == tkd::Add ? l.self + r.self : l.self - r.self, combine(x->op, l.c, r.c)};
+        if (x->op == tkd::Mul) {
+            if (r.c.size() == 1 && !r.self && !l.self)
+                return {0, scale(l.c, r.c[0])};
+            if (l.c.size() == 1 && !l.self && !r.self)
+                return {0, scale(r.c, l.c[0])};
+        }
+        return {0, {}};
+    }
+
+    Chrec solve(PhiInst *p) {
+        auto it = phis.find(p);
+        if (it != phis.end())
+            return it->second;
+        if (p->bb != loop->header || p->vals.size() != 2 || !solving.insert(p).second)
+            return {};
+        bool first = p->vals[0].second == pre_header;
+        auto e = eval(p->vals[first ? 1 : 0].first.value, p);
+        solving.erase(p);
+        Chrec r;
+        if (e.self == 1 && !e.c.empty() && e.c.size() < MAX_DEGREE + 1) {
+            r.push_back(p->vals[first ? 0 : 1].first.value);
+            r.insert(r.end(), e.c.begin(), e.c.end());
+        }
+        return phis[p] = r;
+    }
+
+    // Iterations per entry, which exist as the loop is guarded, as
+    // (span + k) / |s|. Unless s is 1 or -1, the span, span + k, or the iv
+    // going past n may overflow, so ok is made to check they do not, save for
+    // const bounds, counted by simulation. Null if that fails.
+    Value *get_trips(Value *&ok) {
+        int s = t.iv.step, a = std::abs(s);
+        auto *init = t.iv.init, *n = t.n;
+        ok = nullptr;
+        if (a != 1 && is_a<Const>(init) && is_a<Const>(n)) {
+            uint c = get_trip_count(t, MAX_CONST_TRIPS);
+            return c ? Const::of(int(c)) : nullptr;
+        }
+        auto bin = [&](OpKind op, Value *x, Value *y) { return build_bin(op, x, y, at()); };
+        bool up = s > 0;
+        int k = t.op == tkd::Lt || t.op == tkd::Gt ? a - 1 : t.op == tkd::Ne ? 0 : a;
+        auto *span = up ? bin(tkd::Sub, n, init) : bin(tkd::Sub, init, n);
+        if (a != 1) {
+            auto *fits = bin(tkd::Mul, bin(tkd::Ge, span, &Const::ZERO), bin(tkd::Le, span, Const::of(Const::MAX - k)));
+            auto *stops = up ? bin(tkd::Le, n, Const::of(Const::MAX - k)) : bin(tkd::Ge, n, Const::of(Const::MIN + k));
+            ok = bin(tkd::Mul, fits, stops);
+        }
+        return bin(tkd::Div, bin(tkd::Add, span, Const::of(k)), Const::of(a));
+    }
+
+    bool can_count() const {
+        int s = t.iv.step;
+        switch (t.op) {
+            case tkd::Lt: case tkd::Le: return s > 0;
+            case tkd::Gt: case tkd::Ge: return s < 0;
+            case tkd::Ne: return s == 1 || s == -1;
+            default: return false;
+        }
+    }
+
+    // At m = trips - 1, where C(m, 2) is the even one of m and m - 1 halved,
+    // times the other
+    Value *eval_at(const Chrec &c, Value *m) {
+        Value *r = c[0];
+        if (c.size() > 1)
+            r = build_bin(tkd::Add, r, build_bin(tkd::Mul, c[1], m, at()), at());
+        if (c.size() > 2) {
+            auto *odd = build_bin(tkd::Mod, m, Const::of(2), at());
+            auto *even = build_bin(tkd::Sub, m, odd, at());
+            auto *other = build_bin(tkd::Add, build_bin(tkd::Sub, m, &Const::ONE, at()), odd, at());
+            auto *comb = build_bin(tkd::Mul, build_bin(tkd::Div, even, Const::of(2), at()), other, at());
+            r = build_bin(tkd::Add, r, build_bin(tkd::Mul, c[2], comb, at()), at());
+        }
+        return r;
+    }
+
+    // Uses out of the loop take exit values from a bb made to skip it if ok,
+    // or values of the loop from its latch otherwise
+    void version(Value *ok, const vector<std::pair<Inst *, Value *>> &vals) {
+        auto *latch = get_latch(loop), *header = loop->header;
+        auto *skip = f->new_bb_after(pre_header), *merge = f->new_bb_after(latch);
+        auto *jump = pre_header->get_control();
+        pre_header->erase(jump);
+        delete jump;
+        pre_header->push(new BranchInst{ok, skip, header});
+        skip->push(new JumpInst{merge});
+
+        BB *exit = nullptr;
+        for (auto **v: latch->get_succ_mut())
+            if (*v != header) {
+                exit = *v;
+                *v = merge;
+            }
+        retarget_phis(exit, latch, merge);
+        for (auto &p: vals) {
+            auto *x = merge->push(new PhiInst);
+            FOR_LIST_MUT (u, p.first->uses)
+                if (!in_loop(u->user->bb, loop))
+                    u->set(x);
+            x->push(p.first, latch);
+            x->push(p.second, skip);
+        }
+        merge->push(new JumpInst{exit});
+    }
+
+    // Exit values are invariant, and so built in the pre_header, which
+    // dominates all uses out of the loop. Returns if the cfg is changed.
+    bool run(Loop *l) {
+        loop = l;
+        pre_header = get_pre_header(l);
+        if (!pre_header || !get_exit_test(l, t) || !is_guarded(l, t) || !can_count())
+            return false;
+
+        vector<std::pair<Inst *, Chrec>> outs;
+        for (auto *bb: l->bbs)
+            FOR_INST (i, *bb) {
+                if (!i->is_control() && i->has_side_effects())
+                    return false;
+                FOR_LIST (u, i->uses)
+                    if (!in_loop(u->user->bb, l)) {
+                        outs.emplace_back(i, Chrec{});
+                        break;
+                    }
+            }
+        if (outs.empty())
+            return false;
+        phis.clear();
+        exprs.clear();
+        fixed.clear();
+        for (auto &p: outs) {
+            p.second = eval(p.first, nullptr).c;
+            if (p.second.empty())
+                return false;
+        }
+        Value *ok;
+        auto *trips = get_trips(ok);
+        if_a (Const, c, ok) {
+            if (!c->val)
+                return false;
+            ok = nullptr;
+        }
+        if (!trips)
+            return false;
+
+        infof(f->name, ": replacing exit values of loop with header bb", l->header->id, ok ? "under a check" : "");
+        auto *m = build_bin(tkd::Sub, trips, &Const::ONE, at());
+        vector<std::pair<Inst *, Value *>> vals;
+        for (auto &p: outs) {
+            auto *v = eval_at(p.second, m);
+            if (v != p.first)  // or hoisted
+                vals.emplace_back(p.first, v);
+        }
+        if (ok) {
+            version(ok, vals);
+            return true;
+        }
+        for (auto &p: vals)
+            FOR_LIST_MUT (u, p.first->uses)
+                if (!in_loop(u->user->bb, l))
+                    u->set(p.second);
+        return false;
+    }
+};
+
+// Stops once the cfg is changed
+bool run_in(Evolution &e, const vector<Loop *> &loops) {
+    for (auto *l: loops)
+        if (run_in(e, l->chs) || (e.done.insert(l->header).second && e.run(l)))
+            return true;
+    return false;
+}
+
+}
+
+// Inner loops first, so outer ones see their exit values. Loops are found
+// again once one is versioned.
+void scev(Func *f) {
+    Evolution e{f};
+    for (;;) {
+        if (add_pre_headers(f))
+            invalidate(f);
+        require(f, ana::Loops);
+        if (!run_in(e, f->loop_roots))
+            break;
+        invalidate(f);
+    }
+}
@@ -0,0 +1,255 @@
+#include "ir_common.hpp"
+#include <algorithm>
+
+// Strength reduction of addresses in loops. An address linear in a basic
+// induction var, as ptr + terms + coef * iv + c with ptr and terms invariant,
+// becomes a pointer stepped along with the iv, and accesses of the same
+// pointer at different c share it. Then the exit test of the iv is replaced
+// by one on such a pointer, so the iv dies if nothing else uses it.
+
+namespace {
+
+struct Linear {
+    Value *ptr = nullptr;
+    vector<std::pair<Value *, int>> terms;  // invariant ints, by scale
+    PhiInst *iv = nullptr;
+    int coef = 0, c = 0;
+
+    bool same_base(const Linear &o) const {
+        return ptr == o.ptr && terms == o.terms && iv == o.iv && coef == o.coef;
+    }
+};
+
+struct Group {
+    Linear addr;
+    Decl *lhs;
+    vector<std::pair<MemInst *, int>> insts;  // loads, stores and geps, by c
+    PhiInst *p = nullptr;
+    Inst *p_next = nullptr;
+    bool every = false;  // accessed in every iteration
+};
+
+struct Reducer {
+    Func *f;
+    Loop *loop;
+    BB *pre_header, *latch;
+    vector<IndVar> ivs;
+    vector<Group> groups;
+
+    bool is_invariant(Value *v) const {
+        auto *i = as_a<Inst>(v);
+        return !i || !in_loop(i->bb, loop);
+    }
+
+    const IndVar *find_iv(Value *v) const {
+        for (auto &iv: ivs)
+            if (iv.phi == v)
+                return &iv;
+        return nullptr;
+    }
+
+    bool add_int(Value *v, int scale, Linear &r) {
+        if_a (Const, x, v) {
+            r.c += x->val * scale;
+            return true;
+        }
+        if (find_iv(v)) {
+            if (r.iv && r.iv != v)
+                return false;
+            r.iv = static_cast<PhiInst *>(v);
+            r.coef += scale;
+            return true;
+        }
+        if (is_invariant(v)) {
+            for (auto &t: r.terms)
+                if (t.first == v) {
+                    t.second += scale;
+                    return true;
+                }
+            r.terms.emplace_back(v, scale);
+            return true;
+        }
+        auto *x = as_a<BinaryInst>(v);
+        if (!x)
+            return false;
+        if (x->op == tkd::Add)
+            return add_int(x->lhs.value, scale, r) && add_int(x->rhs.value, scale, r);
+        if (x->op == tkd::Sub)
+            return add_int(x->lhs.value, scale, r) && add_int(x->rhs.value, -scale, r);
+        if (x->op == tkd::Mul) {
+            if_a (Const, k, x->rhs.value)
+                return add_int(x->lhs.value, scale * k->val, r);
+            if_a (Const, k, x->lhs.value)
+                return add_int(x->rhs.value, scale * k->val, r);
+        }
+        return false;
+    }
+
+    bool add_ptr(Value *v, Linear &r) {
+        if (is_invariant(v)) {
+            r.ptr = v;
+            return true;
+        }
+        auto *x = as_a<GEPInst>(v);
+        return x && add_ptr(x->base.value, r) && add_int(x->off.value, x->size, r);
+    }
+
+    // Geps only used to address others in the loop are reduced along with them
+    bool is_needed(GEPInst *x) const {
+        FOR_LIST (u, x->uses) {
+            auto *m = as_a<MemInst>(u->user);
+            if (!m || &m->base != u || !in_loop(m->bb, loop))
+                return true;
+        }
+        return false;
+    }
+
+    void collect() {
+        groups.clear();
+        for (auto *bb: loop->bbs) {
+            FOR_INST (i, *bb) {
+                auto *x = as_a<MemInst>(i);
+                if (!x || (is_a<GEPInst>(x) && !is_needed(static_cast<GEPInst *>(x))))
+                    continue;
+                Linear r;
+                if (is_a<GEPInst>(x)) {
+                    if (!add_ptr(x, r))
+                        continue;
+                } else if (!add_ptr(x->base.value, r) || !add_int(x->off.value, 1, r))
+                    continue;
+                if (!r.iv || !r.coef)
+                    continue;
+                auto it = std::find_if(groups.begin(), groups.end(), [&](const Group &g) {
+                    return g.addr.same_base(r);
+                });
+                if (it == groups.end()) {
+                    groups.emplace_back();
+                    it = groups.end() - 1;
+                    it->addr = r;
+                    it->lhs = x->lhs;
+                }
+                it->insts.emplace_back(x, r.c);
+            }
+        }
+    }
+
+    // ptr + terms + coef * v + c, built before the control of the pre_header
+    Value *build_at(const Group &g, Value *v) {
+        auto *ctrl = pre_header->get_control();
+        auto *res = g.addr.ptr;
+        auto gep = [&](Value *off, int size) {
+            auto *i = new GEPInst{g.lhs, res, off, size};
+            insert_before(i, ctrl);
+            res = i;
+        };
+        for (auto &t: g.addr.terms)
+            gep(t.first, t.second);
+        if_a (Const, k, v)
+            gep(Const::of(k->val * g.addr.coef + g.addr.c), 1);
+        else {
+            gep(v, g.addr.coef);
+            if (g.addr.c)
+                gep(Const::of(g.addr.c), 1);
+        }
+        return res;
+    }
+
+    void reduce(Group &g) {
+        auto *iv = find_iv(g.addr.iv);
+        infof(f->name, ": reducing addresses of", g.lhs->name, "in loop with header bb", loop->header->id);
+        g.p = loop->header->push_front(new PhiInst);
+        g.p->push(build_at(g, iv->init), pre_header);
+        g.p_next = new GEPInst{g.lhs, g.p, Const::of(iv->step * g.addr.coef), 1};
+        insert_before(g.p_next, latch->get_control());
+        g.p->push(g.p_next, latch);
+
+        for (auto &q: g.insts) {
+            auto *x = q.first;
+            auto *d = Const::of(q.second - g.addr.c);
+            if (is_a<GEPInst>(x)) {
+                Value *v = g.p;
+                if (d->val) {
+                    v = new GEPInst{g.lhs, g.p, d, 1};
+                    insert_before(static_cast<Inst *>(v), x);
+                }
+                x->replace_uses(v);
+            } else {
+                x->base.set(g.p);
+                x->off.set(d);
+                g.every = g.every || x->bb->doms(latch);
+            }
+        }
+    }
+
+    static bool has_uses(Value *v, std::initializer_list<Inst *> users) {
+        FOR_LIST (u, v->uses)
+            if (std::find(users.begin(), users.end(), u->user) == users.end())
+                return true;
+        return false;
+    }
+
+    // Linear function test replacement on the exit test. The loop must be
+    // guarded by init op n, and an access by the pointer must run in every
+    // iteration, so the pointer compared never goes further than one step
+    // past what the loop accesses.
+    void replace_test(const ExitTest &t) {
+        auto &iv = t.iv;
+        auto op = t.op;
+        if (!is_invariant(t.n) || !(iv.step > 0 ? op == tkd::Lt || op == tkd::Le : op == tkd::Gt || op == tkd::Ge))
+            return;
+        if (has_uses(iv.phi, {iv.next}) || has_uses(iv.next, {iv.phi, t.cmp}) || !is_guarded(loop, t))
+            return;
+
+        for (auto &g: groups) {
+            if (g.addr.iv != iv.phi)
+                continue;
+            if (!g.every)
+                continue;
+            infof(f->name, ": replacing exit test of loop with header bb", loop->header->id);
+            if (g.addr.coef < 0)
+                op = op == tkd::Lt ? tkd::Gt : op == tkd::Le ? tkd::Ge : op == tkd::Gt ? tkd::Lt : tkd::Le;
+            auto *br = static_cast<BranchInst *>(latch->get_control());
+            auto *x = new BinaryInst{op, g.p_next, build_at(g, t.n)};
+            insert_before(x, br);
+            br->cond.set(x);
+            if (br->bb_then != loop->header)
+                std::swap(br->bb_then, br->bb_else);
+            return;
+        }
+    }
+
+    void run(Func *func, Loop *l) {
+        f = func;
+        loop = l;
+        pre_header = get_pre_header(l);
+        latch = get_latch(l);
+        ivs = get_ind_vars(l);
+        if (ivs.empty())
+            return;
+        collect();
+        if (groups.empty())
+            return;
+        for (auto &g: groups)
+            reduce(g);
+        dce(f);
+        ExitTest t;
+        if (get_exit_test(loop, t))
+            replace_test(t);
+    }
+};
+
+void reduce_in(Reducer &r, Func *f, const vector<Loop *> &loops) {
+    for (auto *l: loops) {
+        reduce_in(r, f, l->chs);
+        r.run(f, l);
+    }
+}
+
+}
+
+void sr(Func *f) {
+    add_pre_headers(f);
+    require(f, ana::Loops);
+    Reducer r;
+    reduce_in(r, f, f->loop_roots);
+}
@@ -0,0 +1,88 @@
+#include "ir_common.hpp"
+
+// Scalar replacement of small local arrays. An array that is only loaded and
+// stored at const offsets, directly or through geps at const offsets, and
+// never passed anywhere else, is split into an alloca for each element, which
+// mem2reg then promotes.
+
+namespace {
+
+constexpr uint MAX_SIZE = 16;  // of elements
+
+struct Splitter {
+    Func *f;
+    AllocaInst *a;
+    vector<std::pair<MemInst *, int>> accesses;  // with offsets from a
+    vector<GEPInst *> geps;  // each after its base
+
+    explicit Splitter(Func *f) : f(f) {}
+
+    // Accesses to v, which is at off from a
+    bool collect(Value *v, int off) {
+        FOR_LIST (u, v->uses) {
+            auto *x = as_a<MemInst>(u->user);
+            if (!x || u != &x->base)
+                return false;
+            auto *c = as_a<Const>(x->off.value);
+            if (!c || c->val < 0 || uint(c->val) >= a->var->size() * 4)
+                return false;
+            if_a (GEPInst, g, x) {
+                geps.push_back(g);
+                if (!collect(g, off + c->val * g->size))
+                    return false;
+                continue;
+            }
+            int o = off + c->val;
+            if (o % 4 || uint(o / 4) >= a->var->size())
+                return false;
+            accesses.emplace_back(x, o / 4);
+        }
+        return true;
+    }
+
+    bool run(AllocaInst *x) {
+        a = x;
+        accesses.clear();
+        geps.clear();
+        if (a->var->dims.empty() || a->var->size() > MAX_SIZE || !collect(a, 0))
+            return false;
+        infof(f->name, ": splitting", a->var->name, "into", a->var->size(), "scalars");
+
+        vector<AllocaInst *> elems(a->var->size());
+        for (auto &p: accesses) {
+            auto *&e = elems[p.second];
+            if (!e) {
+                auto *d = new Decl{false, a->var->name + "_" + std::to_string(p.second)};
+                e = f->bbs.front->push_front(new AllocaInst{d});
+                d->value = e;
+            }
+            auto *m = p.first;
+            m->lhs = e->var;
+            m->base.set(e);
+            m->off.set(&Const::ZERO);
+        }
+        for (auto it = geps.rbegin(); it != geps.rend(); ++it) {
+            (*it)->bb->erase(*it);
+            delete *it;
+        }
+        a->var->value = nullptr;
+        a->bb->erase(a);
+        delete a;
+        return true;
+    }
+};
+
+}
+
+void sroa(Func *f) {
+    Splitter sp{f};
+    vector<AllocaInst *> allocas;
+    FOR_BB_INST (i, bb, *f)
+        if_a (AllocaInst, x, i)
+            allocas.push_back(x);
+    bool changed = false;
+    for (auto *x: allocas)
+        changed |= sp.run(x);
+    if (changed)
+        mem2reg(f);
+}
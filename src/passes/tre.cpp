@@ -0,0 +1,118 @@
+#include "ir_common.hpp"
+
+// Tail recursion elimination, after mem2reg. Self calls whose results are
+// returned right away become jumps back to a new header after the entry,
+// where phis take over from the args. Arrays must be passed on as they are
+// taken, and functions with local arrays are left alone, as each call has
+// its own.
+
+namespace {
+
+// The result of c is returned right after it, in its bb or in the bb it
+// jumps to, where only phis from it go before the return
+bool is_tail(Func *f, CallInst *c) {
+    auto *bb = c->bb;
+    if (c->func != f || c->next != bb->insts.back)
+        return false;
+    auto *ret = as_a<ReturnInst>(c->next);
+    BB *to = nullptr;
+    if_a (JumpInst, j, c->next) {
+        to = j->bb_to;
+        Inst *i = to->insts.front;
+        while (is_a<PhiInst>(i))
+            i = i->next;
+        ret = as_a<ReturnInst>(i);
+    }
+    if (!ret)
+        return false;
+
+    auto *v = ret->val.value;
+    if_a (PhiInst, p, v)
+        if (to && p->bb == to)
+            for (auto &q: p->vals)
+                if (q.second == bb)
+                    v = q.first.value;
+    if (v && v != c)
+        return false;
+    FOR_LIST (u, c->uses)
+        if (u->user != ret && !(to && is_a<PhiInst>(u->user) && u->user->bb == to))
+            return false;
+    return true;
+}
+
+}
+
+bool tre(Func *f) {
+    bool has_self_calls = false;
+    FOR_BB_INST (i, bb, *f) {
+        if_a (CallInst, x, i)
+            if (x->func == f)
+                has_self_calls = true;
+        if_a (AllocaInst, x, i)
+            if (!x->var->dims.empty())
+                return false;
+    }
+    if (!has_self_calls)
+        return false;
+
+    auto *entry = f->bbs.front;
+    vector<Argument *> args(f->params.size());
+    vector<CallInst *> sites;
+    FOR_BB (bb, *f) {
+        for (auto *v: bb->get_succ())
+            if (v == entry)
+                return false;  // which would need phis for the edge
+        FOR_INST (i, *bb) {
+            for (auto *u: get_owned_uses(i))
+                if_a (Argument, x, u->value)
+                    args[x->pos] = x;
+            if_a (CallInst, x, i)
+                if (is_tail(f, x))
+                    sites.push_back(x);
+        }
+    }
+    vec_erase_if(sites, [&](CallInst *c) {
+        for (uint k = 0; k < args.size(); ++k)
+            if (args[k] && !f->params[k]->dims.empty() && get_obj(c->args[k].value) != args[k])
+                return true;
+        return false;
+    });
+    if (sites.empty())
+        return false;
+
+    infof(f->name, ": eliminating", sites.size(), "tail calls");
+    auto *header = split_entry(f);
+    entry->push(new JumpInst{header});
+
+    vector<PhiInst *> phis(args.size());
+    for (uint k = 0; k < args.size(); ++k)
+        if (args[k]) {
+            phis[k] = header->push_front(new PhiInst);
+            args[k]->replace_uses(phis[k]);
+            phis[k]->push(args[k], entry);
+        }
+    for (auto *c: sites) {
+        auto *bb = c->bb;
+        for (uint k = 0; k < args.size(); ++k)
+            if (phis[k])
+                phis[k]->push(c->args[k].value, bb);
+        auto *ctrl = bb->insts.back;
+        if_a (JumpInst, j, ctrl) {
+            FOR_INST (i, *j->bb_to) {
+                auto *x = as_a<PhiInst>(i);
+                if (!x)
+                    break;
+                vec_erase_if(x->vals, [&](const std::pair<Use, BB *> &p) { return p.second == bb; });
+            }
+            j->bb_to = header;
+        } else {
+            bb->erase(ctrl);
+            delete ctrl;
+            bb->push(new JumpInst{header});
+        }
+        bb->erase(c);
+        delete c;
+    }
+    invalidate(f);
+    return true;
+}
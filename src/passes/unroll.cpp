@@ -0,0 +1,333 @@
+#include "ir_common.hpp"
+#include <unordered_map>
+#include <set>
+
+// Unrolls innermost loops left only by the exit test of a basic iv. Loops of
+// a small const trip count are unrolled fully, where the loop itself is kept
+// as the last iteration. Others stepped by 1 or -1 are unrolled by a factor
+// into a main loop with a single test per trip, which leaves the iterations
+// remaining to the loop itself.
+
+namespace {
+
+constexpr uint MAX_FULL_TRIP = 16;
+constexpr uint MAX_FULL_SIZE = 256;  // of all iterations
+constexpr uint FACTOR = 4;
+constexpr uint MAX_PARTIAL_SIZE = 48;  // of an iteration
+constexpr uint MAX_FUNC_SIZE = 3000;
+
+uint get_size(Func *f) {
+    uint n = 0;
+    FOR_BB_INST (i, bb, *f)
+        ++n;
+    return n;
+}
+
+struct Unroller {
+    Func *f;
+    Loop *loop;
+    BB *pre_header, *latch, *exit;
+    ExitTest t;
+    vector<BB *> body;  // in layout order
+    vector<PhiInst *> hphis;
+    vector<Value *> inits, backs;  // of hphis
+    std::unordered_map<Value *, Value *> vals;
+    vector<BB *> bbs;  // clones by id
+    vector<std::pair<PhiInst *, PhiInst *>> phis;
+    uint size;
+
+    Value *get(Value *v) {
+        auto it = vals.find(v);
+        return it == vals.end() ? v : it->second;
+    }
+
+    BB *get(BB *u) {
+        asserts(u->id < int(bbs.size()) && bbs[u->id]);
+        return bbs[u->id];
+    }
+
+    Inst *clone(Inst *i) {
+        if_a (BinaryInst, x, i)
+            return new BinaryInst{x->op, get(x->lhs.value), get(x->rhs.value)};
+        if_a (CallInst, x, i) {
+            vector<Value *> argv;
+            argv.reserve(x->args.size());
+            for (auto &u: x->args)
+                argv.push_back(get(u.value));
+            return new CallInst{x->func, argv};
+        }
+        if_a (BranchInst, x, i)
+            return new BranchInst{get(x->cond.value), get(x->bb_then), get(x->bb_else)};
+        if_a (JumpInst, x, i)
+            return new JumpInst{get(x->bb_to)};
+        if_a (LoadInst, x, i)
+            return new LoadInst{x->lhs, get(x->base.value), get(x->off.value)};
+        if_a (StoreInst, x, i)
+            return new StoreInst{x->lhs, get(x->base.value), get(x->off.value), get(x->val.value)};
+        if_a (GEPInst, x, i)
+            return new GEPInst{x->lhs, get(x->base.value), get(x->off.value), x->size};
+        if_a (PhiInst, x, i) {
+            auto *y = new PhiInst;
+            phis.emplace_back(x, y);
+            return y;
+        }
+        unreachable();
+    }
+
+    // Defs dominate their uses except in phis, which are filled at last
+    void clone_dom(BB *u) {
+        auto *bb = get(u);
+        FOR_INST (i, *u) {
+            if (u == loop->header && is_a<PhiInst>(i))
+                continue;
+            if (u == latch && i->is_control())
+                break;
+            vals[i] = bb->push(clone(i));
+        }
+        for (auto *v: u->dom_chs)
+            if (in_loop(v, loop))
+                clone_dom(v);
+    }
+
+    // An iteration placed after after, with hphis taking ins. Its latch is
+    // left without a control.
+    BB *clone_iter(BB *&after, const vector<Value *> &ins) {
+        vals.clear();
+        phis.clear();
+        for (uint k = 0; k < hphis.size(); ++k)
+            vals[hphis[k]] = ins[k];
+        bbs.assign(f->bb_cnt, nullptr);
+        for (auto *u: body)
+            bbs[u->id] = after = f->new_bb_after(after);
+        clone_dom(loop->header);
+        for (auto &p: phis)
+            for (auto &v: p.first->vals)
+                p.second->push(get(v.first.value), get(v.second));
+        return get(loop->header);
+    }
+
+    // What hphis take after the iteration cloned last
+    vector<Value *> get_nexts() {
+        vector<Value *> res;
+        for (auto *v: backs)
+            res.push_back(get(v));
+        return res;
+    }
+
+    bool init(Func *func, Loop *l) {
+        f = func;
+        loop = l;
+        pre_header = get_pre_header(l);
+        latch = get_latch(l);
+        if (!pre_header || !is_a<JumpInst>(pre_header->get_control()) || !get_exit_test(l, t))
+            return false;
+        auto *br = static_cast<BranchInst *>(latch->get_control());
+        exit = br->bb_then == l->header ? br->bb_else : br->bb_then;
+
+        body.clear();
+        FOR_BB (bb, *f)
+            if (in_loop(bb, l))
+                body.push_back(bb);
+        hphis.clear();
+        inits.clear();
+        backs.clear();
+        FOR_INST (i, *l->header) {
+            auto *x = as_a<PhiInst>(i);
+            if (!x)
+                break;
+            asserts(x->vals.size() == 2);
+            bool first = x->vals[0].second == pre_header;
+            hphis.push_back(x);
+            inits.push_back(x->vals[first ? 0 : 1].first.value);
+            backs.push_back(x->vals[first ? 1 : 0].first.value);
+        }
+        size = 0;
+        for (auto *bb: body)
+            FOR_INST (i, *bb)
+                if (!is_a<PhiInst>(i) && !i->is_control())
+                    ++size;
+        return true;
+    }
+
+    void unroll_full(uint trip) {
+        infof(f->name, ": fully unrolling loop with header bb", loop->header->id, "by", trip);
+        auto *last = static_cast<JumpInst *>(pre_header->get_control());
+        auto ins = inits;
+        BB *after = pre_header;
+        for (uint k = 1; k < trip; ++k) {
+            last->bb_to = clone_iter(after, ins);
+            ins = get_nexts();
+            last = get(latch)->push(new JumpInst{loop->header});
+        }
+
+        // The loop itself runs the last iteration
+        for (uint k = 0; k < hphis.size(); ++k) {
+            auto *x = hphis[k];
+            x->replace_uses(ins[k]);
+            loop->header->erase(x);
+            delete x;
+        }
+        auto *br = latch->get_control();
+        latch->erase(br);
+        delete br;
+        latch->push(new JumpInst{exit});
+    }
+
+    // Values of the loop used out of it must go through phis in the exit
+    bool has_live_outs_in_exit() {
+        for (auto *bb: body)
+            FOR_INST (i, *bb)
+                FOR_LIST (u, i->uses)
+                    if (!in_loop(u->user->bb, loop) && !(is_a<PhiInst>(u->user) && u->user->bb == exit))
+                        return false;
+        return true;
+    }
+
+    // The main loop runs while iv.next != end, where end is n minus what
+    // remains of the count, as n - init or init - n, modulo the factor. The
+    // count is exact taken as unsigned, and the factor divides 2^32.
+    bool can_unroll_partial() {
+        int step = t.iv.step;
+        if (!((step == 1 && (t.op == tkd::Lt || t.op == tkd::Ne)) ||
+                (step == -1 && (t.op == tkd::Gt || t.op == tkd::Ne))))
+            return false;
+        return is_guarded(loop, t) && has_live_outs_in_exit();
+    }
+
+    BB *unroll_partial() {
+        infof(f->name, ": unrolling loop with header bb", loop->header->id, "by", FACTOR);
+        auto *jump = pre_header->get_control();
+        auto *init = t.iv.init, *n = t.n;
+        bool up = t.iv.step > 0;
+        auto *count = up ? build_bin(tkd::Sub, n, init, jump) : build_bin(tkd::Sub, init, n, jump);
+        auto *r = build_bin(tkd::Mod, count, Const::of(FACTOR), jump);
+        auto *rem = build_bin(tkd::Mod, build_bin(tkd::Add, r, Const::of(FACTOR), jump), Const::of(FACTOR), jump);
+        auto *end = build_bin(up ? tkd::Sub : tkd::Add, n, rem, jump);
+        auto *enter = build_bin(tkd::Ne, init, end, jump);
+
+        vector<PhiInst *> mphis;
+        for (uint k = 0; k < hphis.size(); ++k)
+            mphis.push_back(new PhiInst);
+        vector<Value *> ins{mphis.begin(), mphis.end()};
+        BB *after = pre_header, *main = nullptr;
+        JumpInst *last = nullptr;
+        for (uint k = 0; k < FACTOR; ++k) {
+            auto *h = clone_iter(after, ins);
+            if (last)
+                last->bb_to = h;
+            else
+                main = h;
+            ins = get_nexts();
+            if (k + 1 < FACTOR)
+                last = get(latch)->push(new JumpInst{nullptr});
+        }
+        auto *main_latch = get(latch);
+        auto *rg = f->new_bb_after(after), *rp = f->new_bb_after(rg);
+
+        // The main loop, entered if a trip of it runs
+        for (uint k = mphis.size(); k--; ) {
+            main->push_front(mphis[k]);
+            mphis[k]->push(inits[k], pre_header);
+            mphis[k]->push(ins[k], main_latch);
+        }
+        pre_header->erase(jump);
+        delete jump;
+        pre_header->push(new BranchInst{enter, main, rg});
+        auto *test = main_latch->push(new BinaryInst{tkd::Ne, get(t.iv.next), end});
+        main_latch->push(new BranchInst{test, main, rg});
+
+        // Then the loop itself, if anything remains
+        Value *iv = nullptr;
+        for (uint k = 0; k < hphis.size(); ++k) {
+            auto *x = rg->push(new PhiInst);
+            x->push(inits[k], pre_header);
+            x->push(ins[k], main_latch);
+            for (auto &v: hphis[k]->vals)
+                if (v.second == pre_header) {
+                    v.first.set(x);
+                    v.second = rp;
+                }
+            if (hphis[k] == t.iv.phi)
+                iv = x;
+        }
+        FOR_INST (i, *exit) {
+            auto *x = as_a<PhiInst>(i);
+            if (!x)
+                break;
+            Value *v = nullptr;
+            for (auto &p: x->vals)
+                if (p.second == latch)
+                    v = p.first.value;
+            auto *def = as_a<Inst>(v);
+            if (def && in_loop(def->bb, loop)) {
+                // Never taken from the pre_header, as the loop runs then
+                auto *y = rg->push(new PhiInst);
+                y->push(&Undef::VAL, pre_header);
+                y->push(get(v), main_latch);
+                v = y;
+            }
+            x->push(v, rg);
+        }
+        rg->push(new BranchInst{rg->push(new BinaryInst{tkd::Ne, iv, n}), rp, exit});
+        rp->push(new JumpInst{loop->header});
+        return main;
+    }
+
+    // Returns the header of a main loop made
+    BB *run(Func *func, Loop *l, uint &func_size) {
+        if (!init(func, l))
+            return nullptr;
+        uint trip = get_trip_count(t, MAX_FULL_TRIP);
+        if (trip && trip * size <= MAX_FULL_SIZE && func_size + trip * size <= MAX_FUNC_SIZE) {
+            unroll_full(trip);
+            func_size += (trip - 1) * size;
+            invalidate(f);
+            return nullptr;
+        }
+        if (size <= MAX_PARTIAL_SIZE && func_size + FACTOR * size <= MAX_FUNC_SIZE && can_unroll_partial()) {
+            auto *res = unroll_partial();
+            func_size += FACTOR * size;
+            invalidate(f);
+            return res;
+        }
+        return nullptr;
+    }
+};
+
+void collect(const vector<Loop *> &loops, vector<BB *> &res) {
+    for (auto *l: loops)
+        if (l->chs.empty())
+            res.push_back(l->header);
+        else
+            collect(l->chs, res);
+}
+
+}
+
+// Outer loops get innermost once those in them are fully unrolled
+void unroll(Func *f) {
+    Unroller u;
+    std::set<BB *> done;
+    uint size = get_size(f);
+    while (true) {
+        add_pre_headers(f);
+        require(f, ana::Loops);
+        vector<BB *> headers;
+        collect(f->loop_roots, headers);
+        bool changed = false;
+        for (auto *h: headers) {
+            if (!done.insert(h).second)
+                continue;
+            changed = true;
+            add_pre_headers(f);
+            require(f, ana::Loops);
+            auto *l = h->loop;
+            if (!l || l->header != h || !l->chs.empty())
+                continue;
+            if (auto *main = u.run(f, l, size))
+                done.insert(main);
+        }
+        if (!changed)
+            break;
+    }
+}
@@ -0,0 +1,249 @@
+#include "ir_common.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <set>
+#include <unordered_map>
+
+// Value range propagation. Ints are taken as intervals, solved optimistically
+// over the bbs in rpo until stable, where phis growing too many times are
+// widened to the next of the thresholds, made of the consts compared with. A
+// use is narrowed by the conds of the edges into the bbs dominating it, and a
+// phi val by the edge it comes by. Values known to be const are replaced, as
+// are comparisons implied by the ranges, and divisions and modulos learn if
+// their lhs is non-negative, to be lowered without fixing the sign.
+
+namespace {
+
+using i64 = long long;
+
+constexpr uint MAX_UPDATES = 3;  // of a phi before it is widened
+constexpr uint MAX_ROUNDS = 64;
+constexpr uint MAX_CLIMB = 8;  // bbs up the dom tree, for conds over a use
+
+constexpr i64 MIN = Const::MIN, MAX = Const::MAX;
+
+struct Range {
+    i64 lo, hi;
+
+    bool empty() const {
+        return lo > hi;
+    }
+
+    bool operator != (const Range &o) const {
+        return lo != o.lo || hi != o.hi;
+    }
+};
+
+constexpr Range FULL{MIN, MAX}, EMPTY{1, 0}, BOOL{0, 1};
+
+// Any that may wrap is full
+Range make(i64 lo, i64 hi) {
+    return lo < MIN || hi > MAX ? FULL : Range{lo, hi};
+}
+
+Range join(const Range &a, const Range &b) {
+    if (a.empty())
+        return b;
+    if (b.empty())
+        return a;
+    return {std::min(a.lo, b.lo), std::max(a.hi, b.hi)};
+}
+
+Range meet(const Range &a, const Range &b) {
+    return {std::max(a.lo, b.lo), std::min(a.hi, b.hi)};
+}
+
+// Values of l where l op r holds for some value of r
+Range constrain(Range l, OpKind op, const Range &r) {
+    switch (op) {
+        case tkd::Lt: return meet(l, {MIN, r.hi - 1});
+        case tkd::Le: return meet(l, {MIN, r.hi});
+        case tkd::Gt: return meet(l, {r.lo + 1, MAX});
+        case tkd::Ge: return meet(l, {r.lo, MAX});
+        case tkd::Eq: return meet(l, r);
+        default:
+            if (r.lo == r.hi && !l.empty()) {
+                if (l.lo == r.lo)
+                    ++l.lo;
+                else if (l.hi == r.lo)
+                    --l.hi;
+            }
+            return l;
+    }
+}
+
+Range compare(OpKind op, const Range &l, const Range &r) {
+    bool lt = l.hi < r.lo, ge = l.lo >= r.hi, le = l.hi <= r.lo, gt = l.lo > r.hi;
+    switch (op) {
+        case tkd::Lt: return lt ? Range{1, 1} : ge ? Range{0, 0} : BOOL;
+        case tkd::Le: return le ? Range{1, 1} : gt ? Range{0, 0} : BOOL;
+        case tkd::Gt: return gt ? Range{1, 1} : le ? Range{0, 0} : BOOL;
+        case tkd::Ge: return ge ? Range{1, 1} : lt ? Range{0, 0} : BOOL;
+        case tkd::Eq: return le && ge ? Range{1, 1} : lt || gt ? Range{0, 0} : BOOL;
+        case tkd::Ne: return le && ge ? Range{0, 0} : lt || gt ? Range{1, 1} : BOOL;
+        default: return BOOL;
+    }
+}
+
+Range eval(OpKind op, const Range &l, const Range &r) {
+    if (l.empty() || r.empty())
+        return EMPTY;
+    switch (op) {
+        case tkd::Add:
+            return make(l.lo + r.lo, l.hi + r.hi);
+        case tkd::Sub:
+            return make(l.lo - r.hi, l.hi - r.lo);
+        case tkd::Mul: {
+            i64 a = l.lo * r.lo, b = l.lo * r.hi, c = l.hi * r.lo, d = l.hi * r.hi;
+            return make(std::min({a, b, c, d}), std::max({a, b, c, d}));
+        }
+        case tkd::Div: {
+            i64 c = r.lo;
+            if (r.lo == r.hi && c && !(c == -1 && l.lo == MIN))
+                return {std::min(l.lo / c, l.hi / c), std::max(l.lo / c, l.hi / c)};
+            if (l.lo >= 0 && r.lo > 0)
+                return {0, l.hi};
+            return FULL;
+        }
+        case tkd::Mod: {
+            i64 m = std::max(std::abs(r.lo), std::abs(r.hi)) - 1;  // |l % r| < |r|
+            if (m < 0)
+                return FULL;
+            if (l.lo >= 0)
+                return {0, std::min(l.hi, m)};
+            if (l.hi <= 0)
+                return {std::max(l.lo, -m), 0};
+            return {std::max(l.lo, -m), std::min(l.hi, m)};
+        }
+        default:
+            return compare(op, l, r);
+    }
+}
+
+struct Solver {
+    Func *f;
+    vector<BB *> rpo;
+    std::unordered_map<Value *, Range> ranges;
+    std::unordered_map<PhiInst *, uint> updates;
+    std::set<i64> thresholds{MIN, MIN + 1, -1, 0, 1, MAX - 1, MAX};
+
+    explicit Solver(Func *f) : f(f) {
+        FOR_BB (bb, *f)
+            rpo.push_back(bb);
+        std::sort(rpo.begin(), rpo.end(), [](BB *a, BB *b) { return a->po > b->po; });
+    }
+
+    Range get(Value *v) {
+        if_a (Const, x, v)
+            return {x->val, x->val};
+        auto it = ranges.find(v);
+        if (it != ranges.end())
+            return it->second;
+        return is_a<PhiInst>(v) || is_a<BinaryInst>(v) ? EMPTY : FULL;  // before solved
+    }
+
+    // r of v, when from goes to to
+    Range refine(Range r, Value *v, BB *from, BB *to) {
+        auto *br = as_a<BranchInst>(from->get_control());
+        OpKind op;
+        Value *w;
+        if (br && get_cond(br, to, v, op, w))
+            r = constrain(r, op, get(w));
+        return r;
+    }
+
+    Range at(Value *v, BB *bb) {
+        auto r = get(v);
+        if (is_a<Const>(v))
+            return r;
+        for (uint k = 0; k < MAX_CLIMB && bb->idom; ++k, bb = bb->idom)
+            if (bb->pred.size() == 1)
+                r = refine(r, v, bb->pred.front(), bb);
+        return r;
+    }
+
+    Range widen(const Range &o, Range r) {
+        if (r.lo < o.lo)
+            r.lo = *std::prev(thresholds.upper_bound(r.lo));
+        if (r.hi > o.hi)
+            r.hi = *thresholds.lower_bound(r.hi);
+        return r;
+    }
+
+    Range eval_inst(Inst *i) {
+        auto *bb = i->bb;
+        if_a (PhiInst, x, i) {
+            auto o = get(x), r = o;
+            for (auto &p: x->vals)
+                r = join(r, refine(at(p.first.value, p.second), p.first.value, p.second, bb));
+            if (r != o && ++updates[x] > MAX_UPDATES)
+                r = widen(o, r);
+            return r;
+        }
+        auto *x = static_cast<BinaryInst *>(i);
+        return eval(x->op, at(x->lhs.value, bb), at(x->rhs.value, bb));
+    }
+
+    bool solve() {
+        FOR_BB_INST (i, bb, *f)
+            if_a (BinaryInst, x, i)
+                for (auto *v: {x->lhs.value, x->rhs.value})
+                    if_a (Const, c, v)
+                        for (i64 d: {-1, 0, 1})
+                            if (c->val + d >= MIN && c->val + d <= MAX)
+                                thresholds.insert(c->val + d);
+        for (uint k = 0; k < MAX_ROUNDS; ++k) {
+            bool changed = false;
+            for (auto *bb: rpo)
+                FOR_INST (i, *bb)
+                    if (is_a<PhiInst>(i) || is_a<BinaryInst>(i)) {
+                        auto r = eval_inst(i);
+                        if (r != get(i)) {
+                            ranges[i] = r;
+                            changed = true;
+                        }
+                    }
+            if (!changed)
+                return true;
+        }
+        return false;
+    }
+
+    // Insts replaced are left to dce, as ranges are keyed by them
+    void apply() {
+        uint folded = 0, nonneg = 0;
+        for (auto *bb: rpo)
+            FOR_INST (i, *bb) {
+                auto *x = as_a<BinaryInst>(i);
+                if (!x || x->uses.empty())
+                    continue;
+                auto r = get(x), l = at(x->lhs.value, bb);
+                if (r.lo == r.hi) {
+                    x->replace_uses(Const::of(int(r.lo)));
+                    ++folded;
+                    continue;
+                }
+                if (x->op != tkd::Div && x->op != tkd::Mod)
+                    continue;
+                auto d = at(x->rhs.value, bb);
+                if (x->op == tkd::Mod && l.lo >= 0 && d.lo > 0 && l.hi < d.lo) {
+                    x->replace_uses(x->lhs.value);
+                    ++folded;
+                } else if (l.lo >= 0 && !x->is_lhs_nonneg) {
+                    x->is_lhs_nonneg = true;
+                    ++nonneg;
+                }
+            }
+        if (folded || nonneg)
+            infof(f->name, ": folded", folded, "insts by ranges, with", nonneg, "non-negative dividends");
+    }
+};
+
+}
+
+void vrp(Func *f) {
+    require(f, ana::Dom);
+    Solver s{f};
+    if (s.solve())
+        s.apply();
+}
@@ -3,6 +3,9 @@
 #include "common.hpp"
 #include <type_traits>
 #include <algorithm>
+#include <vector>
+#include <cstddef>
+#include <initializer_list>
 
 template <class T>
 struct Node {
@@ -97,19 +100,41 @@ struct List {
 #define FOR_LIST(o, l) for (auto *o = (l).front; o; o = o->next)
 #define FOR_LIST_MUT(o, l) for (decltype((l).front) o = (l).front, o##_next; o && ((o##_next = o->next), true); o = o##_next)
 
+// Types with a static classof (e.g. ir::Value) are checked by their tags,
+// while the others fall back to dynamic_cast
+template <typename T, typename U>
+auto isa_impl(U *p, int) -> decltype(std::remove_cv<T>::type::classof(p)) {
+    return std::remove_cv<T>::type::classof(p);
+}
+
+template <typename T, typename U>
+bool isa_impl(U *p, long) {
+    return dynamic_cast<const T *>(p) != nullptr;
+}
+
+template <typename T, typename U>
+auto cast_impl(U *p, int) -> decltype(std::remove_cv<T>::type::classof(p), (T *) nullptr) {
+    return p && std::remove_cv<T>::type::classof(p) ? static_cast<T *>(p) : nullptr;
+}
+
+template <typename T, typename U>
+T *cast_impl(U *p, long) {
+    return dynamic_cast<T *>(p);
+}
+
 template <typename T, typename U>
 T *as_a(U *p) {
     static_assert(std::is_convertible<T *, U *>::value, "invalid as_a");
-    return dynamic_cast<T *>(p);
+    return cast_impl<T>(p, 0);
 }
 
 template <typename T, typename U>
 bool is_a(U *p) {
     static_assert(std::is_convertible<T *, U *>::value, "invalid is_a");
-    return dynamic_cast<const T *>(p) != nullptr;
+    return p && isa_impl<T>(p, 0);
 }
 
-#define if_a(T, x, p) if (auto *x = dynamic_cast<T *>(p))
+#define if_a(T, x, p) if (auto *x = cast_impl<T>(p, 0))
 
 template <typename T, typename U>
 std::size_t vec_erase_if(T &c, U pred) {
@@ -118,3 +143,79 @@ std::size_t vec_erase_if(T &c, U pred) {
     c.erase(it, c.end());
     return r;
 }
+
+// Vector with an inline fixed capacity, to return short lists without allocation
+template <typename T, std::size_t N>
+struct SmallVec {
+    T data[N];
+    std::size_t n = 0;
+
+    SmallVec() = default;
+
+    SmallVec(std::initializer_list<T> l) : n(l.size()) {
+        std::copy(l.begin(), l.end(), data);
+    }
+
+    T *begin() { return data; }
+    T *end() { return data + n; }
+    const T *begin() const { return data; }
+    const T *end() const { return data + n; }
+
+    std::size_t size() const { return n; }
+    bool empty() const { return n == 0; }
+    T &operator [] (std::size_t i) { return data[i]; }
+    const T &operator [] (std::size_t i) const { return data[i]; }
+};
+
+// Bump allocator whose freed chunks are recycled by size, and released at once
+struct Arena {
+    static constexpr const std::size_t ALIGN = alignof(std::max_align_t);
+    static constexpr const std::size_t BLOCK_SIZE = 1 << 16;
+
+    std::vector<char *> blocks;
+    char *cur = nullptr, *end = nullptr;
+    std::vector<void *> free_lists;  // by size / ALIGN, linked through their first words
+
+    Arena() = default;
+    Arena(const Arena &) = delete;
+    Arena &operator = (const Arena &) = delete;
+
+    ~Arena() {
+        release();
+    }
+
+    void *alloc(std::size_t n) {
+        n = (n + ALIGN - 1) / ALIGN;
+        if (n < free_lists.size() && free_lists[n]) {
+            void *p = free_lists[n];
+            free_lists[n] = *static_cast<void **>(p);
+            return p;
+        }
+        n *= ALIGN;
+        if (std::size_t(end - cur) < n) {
+            std::size_t size = n > BLOCK_SIZE ? n : BLOCK_SIZE;
+            cur = static_cast<char *>(::operator new(size));
+            end = cur + size;
+            blocks.push_back(cur);
+        }
+        void *p = cur;
+        cur += n;
+        return p;
+    }
+
+    void free(void *p, std::size_t n) {
+        n = (n + ALIGN - 1) / ALIGN;
+        if (n >= free_lists.size())
+            free_lists.resize(n + 1, nullptr);
+        *static_cast<void **>(p) = free_lists[n];
+        free_lists[n] = p;
+    }
+
+    void release() {
+        for (auto *b: blocks)
+            ::operator delete(b);
+        blocks.clear();
+        free_lists.clear();
+        cur = end = nullptr;
+    }
+};